@@ -0,0 +1,126 @@
+#include "kpdfs.h"
+
+/* Files stored compressed by pdfs-fuse: the data block holds a
+   pdfs_compressed_header followed by an LZ4 block that decompresses to the
+   file's data, up to PDFS_COMPRESS_CLUSTER_BLOCKS blocks of it. The module
+   only reads them. Kernels before 3.11 have no lib/lz4, so this carries
+   its own decoder for the LZ4 block format. */
+
+/* Read a length continued in 255-valued bytes */
+static int pdfs_lz4_length(const u8 **ip, const u8 *iend, size_t *length) {
+    u8 b;
+
+    do {
+        if (*ip >= iend) {
+            return -EIO;
+        }
+        b = *(*ip)++;
+        *length += b;
+    } while (b == 255);
+    return 0;
+}
+
+/* Decode src_len bytes of LZ4 block into at most dst_len bytes. Returns the
+   decoded length, or -EIO when the block is malformed or doesn't fit. */
+static int pdfs_lz4_decode(const u8 *src, size_t src_len,
+                           u8 *dst, size_t dst_len) {
+    const u8 *ip = src;
+    const u8 *iend = src + src_len;
+    u8 *op = dst;
+    u8 *oend = dst + dst_len;
+    size_t length;
+    size_t offset;
+    u8 token;
+
+    while (ip < iend) {
+        token = *ip++;
+
+        /* Literals */
+        length = token >> 4;
+        if (length == 15 && pdfs_lz4_length(&ip, iend, &length)) {
+            return -EIO;
+        }
+        if (length > (size_t)(iend - ip) || length > (size_t)(oend - op)) {
+            return -EIO;
+        }
+        memcpy(op, ip, length);
+        ip += length;
+        op += length;
+
+        /* The last sequence has no match */
+        if (ip == iend) {
+            break;
+        }
+
+        /* Match */
+        if (iend - ip < 2) {
+            return -EIO;
+        }
+        offset = ip[0] | (ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) {
+            return -EIO;
+        }
+        length = token & 15;
+        if (length == 15 && pdfs_lz4_length(&ip, iend, &length)) {
+            return -EIO;
+        }
+        length += 4;
+        if (length > (size_t)(oend - op)) {
+            return -EIO;
+        }
+        /* A match may overlap the bytes it produces */
+        while (length--) {
+            *op = *(op - offset);
+            op++;
+        }
+    }
+    return op - dst;
+}
+
+ssize_t pdfs_read_compressed(struct super_block *sb,
+                                struct pdfs_inode *pdfs_inode,
+                                char __user *buf, size_t nbytes,
+                                loff_t *ppos) {
+    struct pdfs_compressed_header *header;
+    struct buffer_head *bh;
+    char *data;
+    int size = -EIO;
+    ssize_t ret;
+
+    if (pdfs_inode->file_size > sb->s_maxbytes) {
+        return -EIO;
+    }
+    data = kmalloc(pdfs_inode->file_size, GFP_NOFS);
+    if (!data) {
+        return -ENOMEM;
+    }
+
+    bh = sb_bread(sb, pdfs_inode->data_block_no);
+    if (!bh) {
+        printk(KERN_ERR "Failed to read data block %llu\n",
+               pdfs_inode->data_block_no);
+        kfree(data);
+        return -EIO;
+    }
+    header = (struct pdfs_compressed_header *)bh->b_data;
+    if (header->compressed_size <= sb->s_blocksize - sizeof(*header)) {
+        size = pdfs_lz4_decode((u8 *)bh->b_data + sizeof(*header),
+                               header->compressed_size, (u8 *)data,
+                               pdfs_inode->file_size);
+    }
+    brelse(bh);
+
+    if (size != pdfs_inode->file_size) {
+        printk(KERN_ERR "pdfs: corrupt compressed data in block %llu\n",
+               pdfs_inode->data_block_no);
+        ret = -EIO;
+    } else if (copy_to_user(buf, data + *ppos, nbytes)) {
+        ret = -EFAULT;
+    } else {
+        *ppos += nbytes;
+        ret = nbytes;
+    }
+    kfree(data);
+    return ret;
+}
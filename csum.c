@@ -0,0 +1,74 @@
+#include "kpdfs.h"
+
+/* Metadata blocks end with a pdfs_block_tail. Their checksum is checked
+   once, when the block is read into the buffer cache; later readers of the
+   same buffer only test BH_PDFS_Verified. */
+
+static struct pdfs_block_tail *pdfs_block_tail(struct super_block *sb,
+                                                  struct buffer_head *bh) {
+    return (struct pdfs_block_tail *)(bh->b_data + sb->s_blocksize
+                                      - sizeof(struct pdfs_block_tail));
+}
+
+/* crc32c() uses the accelerated implementation when the CPU has one */
+static u32 pdfs_block_csum(struct super_block *sb, struct buffer_head *bh) {
+    uint64_t block_no = bh->b_blocknr;
+    u32 crc;
+
+    /* Including the block number catches misdirected writes */
+    crc = crc32c(~0U, &block_no, sizeof(block_no));
+    return crc32c(crc, bh->b_data,
+                  sb->s_blocksize - sizeof(struct pdfs_block_tail));
+}
+
+int pdfs_verify_meta(struct super_block *sb, struct buffer_head *bh) {
+    int ret = 0;
+
+    if (buffer_pdfs_verified(bh)) {
+        return 0;
+    }
+    /* Updates hold the buffer lock, so the block can't change underneath
+       the check, and only the first reader computes the checksum */
+    lock_buffer(bh);
+    if (!buffer_pdfs_verified(bh)) {
+        if (unlikely(pdfs_block_tail(sb, bh)->checksum
+                != pdfs_block_csum(sb, bh))) {
+            printk(KERN_ERR "pdfs: checksum mismatch in block %llu\n",
+                   (unsigned long long)bh->b_blocknr);
+            ret = -EIO;
+        } else {
+            set_buffer_pdfs_verified(bh);
+        }
+    }
+    unlock_buffer(bh);
+    return ret;
+}
+
+/* sb_bread for metadata blocks. Returns NULL if the block can't be read or
+   its checksum doesn't match. */
+struct buffer_head *pdfs_bread_meta(struct super_block *sb,
+                                       uint64_t block_no) {
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, block_no);
+    if (unlikely(!bh)) {
+        printk(KERN_ERR "pdfs: unable to read block %llu\n", block_no);
+        return NULL;
+    }
+    if (pdfs_verify_meta(sb, bh)) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/* mark_buffer_dirty for metadata blocks, after updating their checksum.
+   Callers lock the buffer before they change the block and unlock it after
+   this, so neither verification nor writeback sees a half-updated block,
+   and concurrent updates of the same inode-table block are ordered. */
+void pdfs_mark_meta_dirty(struct super_block *sb, struct buffer_head *bh) {
+    WARN_ON_ONCE(!buffer_locked(bh));
+    pdfs_block_tail(sb, bh)->checksum = pdfs_block_csum(sb, bh);
+    set_buffer_pdfs_verified(bh);
+    mark_buffer_dirty(bh);
+}
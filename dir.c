@@ -1,25 +1,42 @@
 #include "kpdfs.h"
+#include "kpdfs_trace.h"
+
+/* Whether a higher layer of the directory than layer already has name */
+static bool pdfs_dir_name_shadowed(struct pdfs_inode *dir_pdfs_inode,
+                                      unsigned int layer, const char *name) {
+    struct pdfs_inode *layer_dir;
+    unsigned int i;
+    uint64_t inode_no;
+
+    for (i = 0; i < layer; i++) {
+        layer_dir = pdfs_dir_layer(dir_pdfs_inode, i);
+        if (0 == pdfs_dir_find_inode_no(PDFS_INODE_INFO(layer_dir)->layer_sb,
+                                        layer_dir, name, strlen(name),
+                                        &inode_no)) {
+            return true;
+        }
+    }
+    return false;
+}
 
 int pdfs_readdir(struct file *filp, void *dirent, filldir_t filldir) {
     loff_t pos;
     struct inode *inode;
     struct super_block *sb;
+    struct super_block *layer_sb;
     struct buffer_head *bh;
     struct pdfs_inode *pdfs_inode;
+    struct pdfs_inode *layer_dir;
     struct pdfs_dir_record *dir_record;
+    unsigned long layer_ino;
+    unsigned int layer;
     uint64_t i;
 
-    pos = filp->f_pos;
     inode = filp->f_dentry->d_inode;
     sb = inode->i_sb;
     pdfs_inode = PDFS_INODE(inode);
 
-    if (pos) {
-        // TODO @Sankar: we use a hack of reading pos to figure if we have filled in data.
-        return 0;
-    }
-
-    printk(KERN_INFO "readdir: pdfs_inode->inode_no=%llu", pdfs_inode->inode_no);
+    trace_pdfs_readdir(inode, pdfs_dir_layer_count(pdfs_inode));
 
     if (unlikely(!S_ISDIR(pdfs_inode->mode))) {
         printk(KERN_ERR
@@ -29,18 +46,48 @@ int pdfs_readdir(struct file *filp, void *dirent, filldir_t filldir) {
         return -ENOTDIR;
     }
 
-    bh = sb_bread(sb, pdfs_inode->data_block_no);
-    BUG_ON(!bh);
+    /* Merged view: each layer's entries, minus names a higher layer has.
+       f_pos counts records across the layers in order, so a call that
+       filled the user buffer resumes at the first entry it didn't emit. */
+    pos = 0;
+    for (layer = 0; layer < pdfs_dir_layer_count(pdfs_inode); layer++) {
+        layer_dir = pdfs_dir_layer(pdfs_inode, layer);
+        layer_sb = PDFS_INODE_INFO(layer_dir)->layer_sb;
+        layer_ino = (unsigned long)pdfs_layer_index(sb, layer_sb)
+                    << PDFS_LAYER_INO_SHIFT;
+
+        if (pos + layer_dir->dir_children_count
+                      * sizeof(struct pdfs_dir_record) <= filp->f_pos) {
+            pos += layer_dir->dir_children_count
+                   * sizeof(struct pdfs_dir_record);
+            continue;
+        }
+
+        bh = pdfs_bread_meta(layer_sb, layer_dir->data_block_no);
+        if (unlikely(!bh)) {
+            return -EIO;
+        }
 
-    dir_record = (struct pdfs_dir_record *)bh->b_data;
-    for (i = 0; i < pdfs_inode->dir_children_count; i++) {
-        filldir(dirent, dir_record->filename, PDFS_FILENAME_MAXLEN, pos,
-                dir_record->inode_no, DT_UNKNOWN);
-        filp->f_pos += sizeof(struct pdfs_dir_record);
-        pos += sizeof(struct pdfs_dir_record);
-        dir_record++;
+        dir_record = (struct pdfs_dir_record *)bh->b_data;
+        for (i = 0; i < layer_dir->dir_children_count;
+             i++, dir_record++, pos += sizeof(struct pdfs_dir_record)) {
+            if (pos < filp->f_pos) {
+                continue;
+            }
+            if ((0 == layer || !pdfs_dir_name_shadowed(pdfs_inode, layer,
+                                                       dir_record->filename))
+                    && filldir(dirent, dir_record->filename,
+                               strlen(dir_record->filename), pos,
+                               dir_record->inode_no | layer_ino,
+                               DT_UNKNOWN)) {
+                /* The user buffer is full */
+                brelse(bh);
+                return 0;
+            }
+            filp->f_pos = pos + sizeof(struct pdfs_dir_record);
+        }
+        brelse(bh);
     }
-    brelse(bh);
 
     return 0;
 }
@@ -1,7 +1,15 @@
 #include "kpdfs.h"
+#include "kpdfs_trace.h"
 
-ssize_t pdfs_read(struct file *filp, char __user *buf, size_t len,
-                     loff_t *ppos) {
+int pdfs_file_open(struct inode *inode, struct file *filp) {
+    if ((filp->f_mode & FMODE_WRITE) && pdfs_inode_in_lower_layer(inode)) {
+        return -EROFS;
+    }
+    return 0;
+}
+
+static ssize_t pdfs_do_read(struct file *filp, char __user *buf,
+                               size_t len, loff_t *ppos) {
     struct super_block *sb;
     struct inode *inode;
     struct pdfs_inode *pdfs_inode;
@@ -10,13 +18,28 @@ ssize_t pdfs_read(struct file *filp, char __user *buf, size_t len,
     int nbytes;
 
     inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
+    sb = PDFS_INODE_SB(inode);
     pdfs_inode = PDFS_INODE(inode);
     
     if (*ppos >= pdfs_inode->file_size) {
         return 0;
     }
 
+    nbytes = min((size_t)(pdfs_inode->file_size - *ppos), len);
+
+    if (pdfs_inode->flags & PDFS_INODE_FL_COMPRESSED) {
+        return pdfs_read_compressed(sb, pdfs_inode, buf, nbytes, ppos);
+    }
+
+    /* Preallocated but never written: zeros, without reading the block */
+    if (pdfs_inode->flags & PDFS_INODE_FL_UNWRITTEN) {
+        if (clear_user(buf, nbytes)) {
+            return -EFAULT;
+        }
+        *ppos += nbytes;
+        return nbytes;
+    }
+
     bh = sb_bread(sb, pdfs_inode->data_block_no);
     if (!bh) {
         printk(KERN_ERR "Failed to read data block %llu\n",
@@ -25,7 +48,6 @@ ssize_t pdfs_read(struct file *filp, char __user *buf, size_t len,
     }
 
     buffer = (char *)bh->b_data + *ppos;
-    nbytes = min((size_t)(pdfs_inode->file_size - *ppos), len);
 
     if (copy_to_user(buf, buffer, nbytes)) {
         brelse(bh);
@@ -43,8 +65,8 @@ ssize_t pdfs_read(struct file *filp, char __user *buf, size_t len,
    If we hook file_operations.write = do_sync_write,
    and file_operations.aio_write = generic_file_aio_write,
    we will use write to pagecache instead. */
-ssize_t pdfs_write(struct file *filp, const char __user *buf, size_t len,
-                      loff_t *ppos) {
+static ssize_t pdfs_do_write(struct file *filp, const char __user *buf,
+                                size_t len, loff_t *ppos) {
     struct super_block *sb;
     struct inode *inode;
     struct pdfs_inode *pdfs_inode;
@@ -58,12 +80,39 @@ ssize_t pdfs_write(struct file *filp, const char __user *buf, size_t len,
     pdfs_inode = PDFS_INODE(inode);
     pdfs_sb = PDFS_SB(sb);
 
+    if (pdfs_inode_in_lower_layer(inode)) {
+        return -EROFS;
+    }
+
     ret = generic_write_checks(filp, ppos, &len, 0);
     if (ret) {
         return ret;
     }
 
-    bh = sb_bread(sb, pdfs_inode->data_block_no);
+    /* Only pdfs-fuse writes compressed files */
+    if (pdfs_inode->flags & PDFS_INODE_FL_COMPRESSED) {
+        return -EOPNOTSUPP;
+    }
+
+    /* s_maxbytes allows for compressed files; this one is stored raw */
+    if (*ppos >= sb->s_blocksize) {
+        return -EFBIG;
+    }
+    len = min_t(size_t, len, sb->s_blocksize - *ppos);
+
+    if (pdfs_inode->flags & PDFS_INODE_FL_UNWRITTEN) {
+        /* First write converts the unwritten block: zero it in memory
+           instead of reading stale contents from disk */
+        bh = sb_getblk(sb, pdfs_inode->data_block_no);
+        if (bh) {
+            lock_buffer(bh);
+            memset(bh->b_data, 0, bh->b_size);
+            set_buffer_uptodate(bh);
+            unlock_buffer(bh);
+        }
+    } else {
+        bh = sb_bread(sb, pdfs_inode->data_block_no);
+    }
     if (!bh) {
         printk(KERN_ERR "Failed to read data block %llu\n",
                pdfs_inode->data_block_no);
@@ -84,11 +133,367 @@ ssize_t pdfs_write(struct file *filp, const char __user *buf, size_t len,
     sync_dirty_buffer(bh);
     brelse(bh);
 
+    pdfs_inode->flags &= ~PDFS_INODE_FL_UNWRITTEN;
     pdfs_inode->file_size = max((size_t)(pdfs_inode->file_size),
                                    (size_t)(*ppos));
     pdfs_save_pdfs_inode(sb, pdfs_inode);
-
-    /* TODO We didn't update file size here. To be frank I don't know how. */
+    i_size_write(inode, pdfs_inode->file_size);
 
     return len;
 }
+
+ssize_t pdfs_read(struct file *filp, char __user *buf, size_t len,
+                     loff_t *ppos) {
+    struct inode *inode = filp->f_path.dentry->d_inode;
+    loff_t pos = *ppos;
+    u64 start = pdfs_stats_start();
+    ssize_t ret;
+
+    ret = pdfs_do_read(filp, buf, len, ppos);
+
+    trace_pdfs_read(inode, pos, len, ret);
+    pdfs_stats_end(inode->i_sb, PDFS_OP_READ, start, ret);
+    return ret;
+}
+
+ssize_t pdfs_write(struct file *filp, const char __user *buf, size_t len,
+                      loff_t *ppos) {
+    struct inode *inode = filp->f_path.dentry->d_inode;
+    loff_t pos = *ppos;
+    u64 start = pdfs_stats_start();
+    ssize_t ret;
+
+    ret = pdfs_do_write(filp, buf, len, ppos);
+
+    trace_pdfs_write(inode, pos, len, ret);
+    pdfs_stats_end(inode->i_sb, PDFS_OP_WRITE, start, ret);
+    return ret;
+}
+
+/* Zero [start, end) of the data block of a written inode */
+static int pdfs_zero_range(struct super_block *sb,
+                              struct pdfs_inode *pdfs_inode,
+                              loff_t start, loff_t end) {
+    struct buffer_head *bh;
+
+    bh = sb_bread(sb, pdfs_inode->data_block_no);
+    if (!bh) {
+        printk(KERN_ERR "Failed to read data block %llu\n",
+               pdfs_inode->data_block_no);
+        return -EIO;
+    }
+
+    memset(bh->b_data + start, 0, end - start);
+    mark_buffer_dirty(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+    return 0;
+}
+
+/* Every inode owns its data block from creation, so preallocation only has
+   to make the range read as zeros. An inode without written data is flagged
+   unwritten; otherwise the new tail past EOF is zeroed on disk. */
+static int pdfs_prealloc(struct inode *inode, int mode,
+                            loff_t offset, loff_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct pdfs_inode *pdfs_inode = PDFS_INODE(inode);
+    int ret;
+
+    if (end > sb->s_blocksize) {
+        return -EFBIG;
+    }
+
+    if (0 == pdfs_inode->file_size) {
+        pdfs_inode->flags |= PDFS_INODE_FL_UNWRITTEN;
+    } else if (!(pdfs_inode->flags & PDFS_INODE_FL_UNWRITTEN)
+               && !(mode & FALLOC_FL_KEEP_SIZE)
+               && end > pdfs_inode->file_size) {
+        ret = pdfs_zero_range(sb, pdfs_inode, pdfs_inode->file_size, end);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    if (!(mode & FALLOC_FL_KEEP_SIZE) && end > pdfs_inode->file_size) {
+        pdfs_inode->file_size = end;
+        i_size_write(inode, end);
+    }
+
+    pdfs_save_pdfs_inode(sb, pdfs_inode);
+    return 0;
+}
+
+/* Punching the whole file turns it back into an unwritten block with no
+   I/O; a partial hole is zeroed in place. The size never changes. */
+static int pdfs_punch_hole(struct inode *inode, loff_t offset, loff_t end) {
+    struct super_block *sb = inode->i_sb;
+    struct pdfs_inode *pdfs_inode = PDFS_INODE(inode);
+
+    end = min_t(loff_t, end, pdfs_inode->file_size);
+    if (offset >= end || (pdfs_inode->flags & PDFS_INODE_FL_UNWRITTEN)) {
+        return 0;
+    }
+
+    if (0 == offset && end == pdfs_inode->file_size) {
+        pdfs_inode->flags |= PDFS_INODE_FL_UNWRITTEN;
+        pdfs_save_pdfs_inode(sb, pdfs_inode);
+        return 0;
+    }
+
+    return pdfs_zero_range(sb, pdfs_inode, offset, end);
+}
+
+long pdfs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len) {
+    struct inode *inode;
+    struct pdfs_inode *pdfs_inode;
+    long ret;
+
+    inode = filp->f_path.dentry->d_inode;
+    pdfs_inode = PDFS_INODE(inode);
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+        return -EOPNOTSUPP;
+    }
+    if (pdfs_inode_in_lower_layer(inode)) {
+        return -EROFS;
+    }
+
+    mutex_lock(&inode->i_mutex);
+    if (pdfs_inode->flags & PDFS_INODE_FL_COMPRESSED) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        ret = pdfs_punch_hole(inode, offset, offset + len);
+    } else {
+        ret = pdfs_prealloc(inode, mode, offset, offset + len);
+    }
+    if (0 == ret) {
+        inode->i_mtime = inode->i_ctime = CURRENT_TIME;
+    }
+out:
+    mutex_unlock(&inode->i_mutex);
+
+    return ret;
+}
+
+/* Shrinking zeroes the cut tail on disk, so the bytes past EOF keep
+   reading as zeros when the file grows again; growing is a preallocation.
+   Cutting the file to nothing makes its block unwritten, with no I/O. */
+static int pdfs_truncate(struct inode *inode, loff_t size) {
+    struct super_block *sb = inode->i_sb;
+    struct pdfs_inode *pdfs_inode = PDFS_INODE(inode);
+    int ret;
+
+    if (pdfs_inode->flags & PDFS_INODE_FL_COMPRESSED) {
+        return -EOPNOTSUPP;
+    }
+    if (size > pdfs_inode->file_size) {
+        return pdfs_prealloc(inode, 0, pdfs_inode->file_size, size);
+    }
+
+    if (0 == size) {
+        pdfs_inode->flags |= PDFS_INODE_FL_UNWRITTEN;
+    } else if (!(pdfs_inode->flags & PDFS_INODE_FL_UNWRITTEN)) {
+        ret = pdfs_zero_range(sb, pdfs_inode, size, pdfs_inode->file_size);
+        if (ret) {
+            return ret;
+        }
+    }
+    pdfs_inode->file_size = size;
+    pdfs_save_pdfs_inode(sb, pdfs_inode);
+    i_size_write(inode, size);
+    return 0;
+}
+
+/* Called with i_mutex held. Besides the size, only the mode is on disk;
+   the other attributes live in the in-memory inode, as they did before. */
+int pdfs_setattr(struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = dentry->d_inode;
+    struct pdfs_inode *pdfs_inode = PDFS_INODE(inode);
+    int ret;
+
+    if (pdfs_inode_in_lower_layer(inode)) {
+        return -EROFS;
+    }
+    ret = inode_change_ok(inode, attr);
+    if (ret) {
+        return ret;
+    }
+
+    if ((attr->ia_valid & ATTR_SIZE) && S_ISREG(inode->i_mode)
+            && attr->ia_size != i_size_read(inode)) {
+        ret = pdfs_truncate(inode, attr->ia_size);
+        if (ret) {
+            return ret;
+        }
+    }
+
+    setattr_copy(inode, attr);
+    if (attr->ia_valid & ATTR_MODE) {
+        pdfs_inode->mode = inode->i_mode;
+        pdfs_save_pdfs_inode(inode->i_sb, pdfs_inode);
+    }
+    mark_inode_dirty(inode);
+    return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 3, 0)
+#define pdfs_file_remove_suid file_remove_privs
+#else
+#define pdfs_file_remove_suid file_remove_suid
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 13, 0)
+#define pdfs_lock_two_inodes lock_two_nondirectories
+#define pdfs_unlock_two_inodes unlock_two_nondirectories
+#else
+/* lock_two_nondirectories() for kernels that don't have it: lock in inode
+   address order so two copies in opposite directions can't deadlock */
+static void pdfs_lock_two_inodes(struct inode *inode1, struct inode *inode2) {
+    if (inode1 > inode2) {
+        swap(inode1, inode2);
+    }
+    mutex_lock(&inode1->i_mutex);
+    if (inode2 != inode1) {
+        mutex_lock_nested(&inode2->i_mutex, I_MUTEX_CHILD);
+    }
+}
+
+static void pdfs_unlock_two_inodes(struct inode *inode1,
+                                   struct inode *inode2) {
+    mutex_unlock(&inode1->i_mutex);
+    if (inode2 != inode1) {
+        mutex_unlock(&inode2->i_mutex);
+    }
+}
+#endif
+
+/* Copy a byte range between two pdfs files inside the buffer cache. Each
+   inode has a single data block, so this is at most one block read and
+   one block write; the destination block isn't read when the copy
+   replaces all of its data. */
+ssize_t pdfs_copy_range(struct file *file_in, loff_t pos_in,
+                           struct file *file_out, loff_t pos_out,
+                           size_t len) {
+    struct inode *inode_in;
+    struct inode *inode_out;
+    struct super_block *sb;
+    struct pdfs_inode *pdfs_inode_in;
+    struct pdfs_inode *pdfs_inode_out;
+    struct buffer_head *bh_in;
+    struct buffer_head *bh_out;
+    ssize_t ret;
+
+    inode_in = file_in->f_path.dentry->d_inode;
+    inode_out = file_out->f_path.dentry->d_inode;
+    sb = inode_out->i_sb;
+    pdfs_inode_in = PDFS_INODE(inode_in);
+    pdfs_inode_out = PDFS_INODE(inode_out);
+
+    if (inode_in->i_sb != sb) {
+        return -EXDEV;
+    }
+    if (!S_ISREG(inode_in->i_mode) || !S_ISREG(inode_out->i_mode)) {
+        return -EINVAL;
+    }
+    if (pos_in < 0 || pos_out < 0) {
+        return -EINVAL;
+    }
+    if (pdfs_inode_in_lower_layer(inode_out)) {
+        return -EROFS;
+    }
+
+    /* The source can't be truncated or written underneath the copy */
+    pdfs_lock_two_inodes(inode_in, inode_out);
+
+    if (pos_in >= pdfs_inode_in->file_size) {
+        ret = 0;
+        goto out;
+    }
+    len = min_t(size_t, len, pdfs_inode_in->file_size - pos_in);
+    /* Copies are done block to block, on raw data only */
+    if ((pdfs_inode_in->flags | pdfs_inode_out->flags)
+            & PDFS_INODE_FL_COMPRESSED) {
+        ret = -EOPNOTSUPP;
+        goto out;
+    }
+    if (pos_out + len > sb->s_blocksize) {
+        ret = -EFBIG;
+        goto out;
+    }
+    /* Writing someone else's setuid file drops the bit, as write() does */
+    ret = pdfs_file_remove_suid(file_out);
+    if (ret) {
+        goto out;
+    }
+
+    if (pdfs_inode_in->flags & PDFS_INODE_FL_UNWRITTEN) {
+        /* Copying zeros: nothing to do for an unwritten destination */
+        if (!(pdfs_inode_out->flags & PDFS_INODE_FL_UNWRITTEN)) {
+            ret = pdfs_zero_range(sb, pdfs_inode_out, pos_out,
+                                  pos_out + len);
+            if (ret) {
+                goto out;
+            }
+        }
+    } else {
+        bh_in = sb_bread(PDFS_INODE_SB(inode_in),
+                         pdfs_inode_in->data_block_no);
+        if (!bh_in) {
+            printk(KERN_ERR "Failed to read data block %llu\n",
+                   pdfs_inode_in->data_block_no);
+            ret = -EIO;
+            goto out;
+        }
+
+        if (pdfs_inode_out->flags & PDFS_INODE_FL_UNWRITTEN
+                || (0 == pos_out && len >= pdfs_inode_out->file_size)) {
+            bh_out = sb_getblk(sb, pdfs_inode_out->data_block_no);
+            if (bh_out && bh_out != bh_in) {
+                lock_buffer(bh_out);
+                memset(bh_out->b_data, 0, bh_out->b_size);
+                set_buffer_uptodate(bh_out);
+                unlock_buffer(bh_out);
+            }
+        } else {
+            bh_out = sb_bread(sb, pdfs_inode_out->data_block_no);
+        }
+        if (!bh_out) {
+            printk(KERN_ERR "Failed to read data block %llu\n",
+                   pdfs_inode_out->data_block_no);
+            brelse(bh_in);
+            ret = -EIO;
+            goto out;
+        }
+
+        /* Source and destination may be the same file */
+        memmove(bh_out->b_data + pos_out, bh_in->b_data + pos_in, len);
+        mark_buffer_dirty(bh_out);
+        sync_dirty_buffer(bh_out);
+        brelse(bh_out);
+        brelse(bh_in);
+
+        pdfs_inode_out->flags &= ~PDFS_INODE_FL_UNWRITTEN;
+    }
+
+    pdfs_inode_out->file_size = max_t(uint64_t, pdfs_inode_out->file_size,
+                                      pos_out + len);
+    pdfs_save_pdfs_inode(sb, pdfs_inode_out);
+    i_size_write(inode_out, pdfs_inode_out->file_size);
+    inode_out->i_mtime = inode_out->i_ctime = CURRENT_TIME;
+    ret = len;
+
+out:
+    pdfs_unlock_two_inodes(inode_in, inode_out);
+    return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+ssize_t pdfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                struct file *file_out, loff_t pos_out,
+                                size_t len, unsigned int flags) {
+    return pdfs_copy_range(file_in, pos_in, file_out, pos_out, len);
+}
+#endif
@@ -1,18 +1,120 @@
 #include "kpdfs.h"
+#include "kpdfs_trace.h"
 
 void pdfs_destroy_inode(struct inode *inode) {
     struct pdfs_inode *pdfs_inode = PDFS_INODE(inode);
 
-    printk(KERN_INFO "Freeing private data of inode %p (%lu)\n",
-           pdfs_inode, inode->i_ino);
+    if (pdfs_inode) {
+        pdfs_free_inode_buf(pdfs_inode);
+    }
+}
+
+/* Called when the last reference to an inode is dropped. Once it is no
+   longer linked from any directory, its data block and on-disk inode are
+   given back to the bitmaps. */
+void pdfs_evict_inode(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct pdfs_inode *pdfs_inode = PDFS_INODE(inode);
+
+    truncate_inode_pages(&inode->i_data, 0);
+    clear_inode(inode);
+
+    if (inode->i_nlink || !pdfs_inode) {
+        return;
+    }
+
+    pdfs_free_data_block(sb, pdfs_inode->data_block_no);
+    pdfs_free_pdfs_inode(sb, pdfs_inode->inode_no);
+}
+
+/* Allocate an in-memory pdfs_inode living in sb, with its in-memory only
+   state reset */
+static struct pdfs_inode *pdfs_alloc_inode_buf(struct super_block *sb) {
+    struct pdfs_inode_info *info;
+
+    info = kmem_cache_alloc(pdfs_inode_cache, GFP_KERNEL);
+    if (!info) {
+        return NULL;
+    }
+    info->layer_sb = sb;
+    info->layer = 0;
+    info->lower_dirs = NULL;
+    info->dir_bloom_valid = false;
+    bitmap_zero(info->dir_bloom, PDFS_DIR_BLOOM_BITS);
+    return &info->pdfs_inode;
+}
+
+void pdfs_free_inode_buf(struct pdfs_inode *pdfs_inode) {
+    struct pdfs_lower_dirs *lower_dirs;
+    unsigned int i;
+
+    lower_dirs = PDFS_INODE_INFO(pdfs_inode)->lower_dirs;
+    if (lower_dirs) {
+        for (i = 0; i < lower_dirs->count; i++) {
+            pdfs_free_inode_buf(lower_dirs->dirs[i]);
+        }
+        kfree(lower_dirs);
+    }
     kmem_cache_free(pdfs_inode_cache, pdfs_inode);
 }
 
+/* Merge a directory of a lower layer into dir_pdfs_inode, which takes
+   ownership of it */
+int pdfs_add_lower_dir(struct pdfs_inode *dir_pdfs_inode,
+                          struct pdfs_inode *lower_dir_pdfs_inode) {
+    struct pdfs_inode_info *info = PDFS_INODE_INFO(dir_pdfs_inode);
+
+    if (!info->lower_dirs) {
+        info->lower_dirs = kzalloc(sizeof(*info->lower_dirs), GFP_KERNEL);
+        if (!info->lower_dirs) {
+            return -ENOMEM;
+        }
+    }
+    if (WARN_ON(info->lower_dirs->count >= PDFS_MAX_LAYERS - 1)) {
+        return -ELOOP;
+    }
+    info->lower_dirs->dirs[info->lower_dirs->count++] = lower_dir_pdfs_inode;
+    return 0;
+}
+
+/* Number of layers a directory spans, itself included */
+unsigned int pdfs_dir_layer_count(struct pdfs_inode *dir_pdfs_inode) {
+    struct pdfs_lower_dirs *lower_dirs;
+
+    lower_dirs = PDFS_INODE_INFO(dir_pdfs_inode)->lower_dirs;
+    return 1 + (lower_dirs ? lower_dirs->count : 0);
+}
+
+/* The i-th layer of a directory, topmost first. The layer's superblock is
+   PDFS_INODE_INFO(result)->layer_sb. */
+struct pdfs_inode *pdfs_dir_layer(struct pdfs_inode *dir_pdfs_inode,
+                                     unsigned int i) {
+    if (0 == i) {
+        return dir_pdfs_inode;
+    }
+    return PDFS_INODE_INFO(dir_pdfs_inode)->lower_dirs->dirs[i - 1];
+}
+
+unsigned int pdfs_layer_index(struct super_block *sb,
+                                 struct super_block *layer_sb) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    unsigned int i;
+
+    for (i = 0; i < sbi->layer_count; i++) {
+        if (sbi->layers[i] == layer_sb) {
+            return i;
+        }
+    }
+    return 0;
+}
+
 void pdfs_fill_inode(struct super_block *sb, struct inode *inode,
                         struct pdfs_inode *pdfs_inode) {
     inode->i_mode = pdfs_inode->mode;
     inode->i_sb = sb;
-    inode->i_ino = pdfs_inode->inode_no;
+    inode->i_ino = pdfs_inode->inode_no
+                 | ((unsigned long)PDFS_INODE_INFO(pdfs_inode)->layer
+                    << PDFS_LAYER_INO_SHIFT);
     inode->i_op = &pdfs_inode_ops;
     // TODO hope we can use pdfs_inode to store timespec
     inode->i_atime = inode->i_mtime 
@@ -24,17 +126,15 @@ void pdfs_fill_inode(struct super_block *sb, struct inode *inode,
         inode->i_fop = &pdfs_dir_operations;
     } else if (S_ISREG(pdfs_inode->mode)) {
         inode->i_fop = &pdfs_file_operations;
+        inode->i_size = pdfs_inode->file_size;
     } else {
         printk(KERN_WARNING
                "Inode %lu is neither a directory nor a regular file",
                inode->i_ino);
         inode->i_fop = NULL;
     }
-
-    /* TODO pdfs_inode->file_size seems not reflected in inode */
 }
 
-/* TODO I didn't implement any function to dealloc pdfs_inode */
 int pdfs_alloc_pdfs_inode(struct super_block *sb, uint64_t *out_inode_no) {
     struct pdfs_superblock *pdfs_sb;
     struct buffer_head *bh;
@@ -43,14 +143,20 @@ int pdfs_alloc_pdfs_inode(struct super_block *sb, uint64_t *out_inode_no) {
     char *bitmap;
     char *slot;
     char needle;
+    u64 start = pdfs_stats_start();
 
     pdfs_sb = PDFS_SB(sb);
 
     mutex_lock(&pdfs_sb_lock);
 
-    bh = sb_bread(sb, PDFS_INODE_BITMAP_BLOCK_NO);
-    BUG_ON(!bh);
+    bh = pdfs_bread_meta(sb, PDFS_INODE_BITMAP_BLOCK_NO);
+    if (unlikely(!bh)) {
+        mutex_unlock(&pdfs_sb_lock);
+        ret = -EIO;
+        goto out;
+    }
 
+    lock_buffer(bh);
     bitmap = bh->b_data;
     ret = -ENOSPC;
     for (i = 0; i < pdfs_sb->inode_table_size; i++) {
@@ -65,30 +171,110 @@ int pdfs_alloc_pdfs_inode(struct super_block *sb, uint64_t *out_inode_no) {
         }
     }
 
-    mark_buffer_dirty(bh);
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
     pdfs_save_sb(sb);
 
     mutex_unlock(&pdfs_sb_lock);
+
+out:
+    trace_pdfs_alloc_pdfs_inode(sb, ret ? 0 : *out_inode_no, ret);
+    pdfs_stats_end(sb, PDFS_OP_ALLOC_INODE, start, ret);
     return ret;
 }
 
+void pdfs_free_pdfs_inode(struct super_block *sb, uint64_t inode_no) {
+    struct pdfs_superblock *pdfs_sb;
+    struct buffer_head *bh;
+    char *slot;
+    char needle;
+
+    pdfs_sb = PDFS_SB(sb);
+
+    mutex_lock(&pdfs_sb_lock);
+
+    bh = pdfs_bread_meta(sb, PDFS_INODE_BITMAP_BLOCK_NO);
+    if (unlikely(!bh)) {
+        /* The inode stays allocated */
+        mutex_unlock(&pdfs_sb_lock);
+        return;
+    }
+
+    trace_pdfs_free_pdfs_inode(sb, inode_no, 0);
+
+    lock_buffer(bh);
+    slot = bh->b_data + inode_no / BITS_IN_BYTE;
+    needle = 1 << (inode_no % BITS_IN_BYTE);
+    if (likely(*slot & needle)) {
+        *slot &= ~needle;
+        pdfs_sb->inode_count -= 1;
+    } else {
+        printk(KERN_WARNING "Freeing inode %llu which is not in use\n",
+               inode_no);
+    }
+
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+    pdfs_save_sb(sb);
+
+    mutex_unlock(&pdfs_sb_lock);
+}
+
+/* On a cache miss in the inode table, read the missed block and the next
+   ones in a single plugged batch: inodes created together sit together,
+   so a tree walk is about to need them. */
+static void pdfs_inode_table_readahead(struct super_block *sb,
+                                          uint64_t block_no) {
+    struct buffer_head *bh;
+    struct blk_plug plug;
+    uint64_t end;
+    bool cached;
+
+    bh = sb_find_get_block(sb, block_no);
+    if (bh) {
+        cached = buffer_uptodate(bh);
+        brelse(bh);
+        if (cached) {
+            return;
+        }
+    }
+
+    end = min(block_no + PDFS_INODE_READAHEAD_BLOCKS,
+              PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb));
+    blk_start_plug(&plug);
+    for (; block_no < end; block_no++) {
+        sb_breadahead(sb, block_no);
+    }
+    blk_finish_plug(&plug);
+}
+
+/* Returns an ERR_PTR if the inode can't be read or allocated */
 struct pdfs_inode *pdfs_get_pdfs_inode(struct super_block *sb,
                                                 uint64_t inode_no) {
     struct buffer_head *bh;
     struct pdfs_inode *inode;
     struct pdfs_inode *inode_buf;
+    uint64_t block_no;
 
-    bh = sb_bread(sb, PDFS_INODE_TABLE_START_BLOCK_NO + PDFS_INODE_BLOCK_OFFSET(sb, inode_no));
-    BUG_ON(!bh);
+    block_no = PDFS_INODE_TABLE_START_BLOCK_NO + PDFS_INODE_BLOCK_OFFSET(sb, inode_no);
+    pdfs_inode_table_readahead(sb, block_no);
+    bh = pdfs_bread_meta(sb, block_no);
+    if (unlikely(!bh)) {
+        return ERR_PTR(-EIO);
+    }
     
     inode = (struct pdfs_inode *)(bh->b_data + PDFS_INODE_BYTE_OFFSET(sb, inode_no));
-    inode_buf = kmem_cache_alloc(pdfs_inode_cache, GFP_KERNEL);
-    memcpy(inode_buf, inode, sizeof(*inode_buf));
+    inode_buf = pdfs_alloc_inode_buf(sb);
+    if (inode_buf) {
+        memcpy(inode_buf, inode, sizeof(*inode_buf));
+    }
 
     brelse(bh);
-    return inode_buf;
+    return inode_buf ? inode_buf : ERR_PTR(-ENOMEM);
 }
 
 void pdfs_save_pdfs_inode(struct super_block *sb,
@@ -98,17 +284,71 @@ void pdfs_save_pdfs_inode(struct super_block *sb,
     uint64_t inode_no;
 
     inode_no = inode_buf->inode_no;
-    bh = sb_bread(sb, PDFS_INODE_TABLE_START_BLOCK_NO + PDFS_INODE_BLOCK_OFFSET(sb, inode_no));
-    BUG_ON(!bh);
+    bh = pdfs_bread_meta(sb, PDFS_INODE_TABLE_START_BLOCK_NO + PDFS_INODE_BLOCK_OFFSET(sb, inode_no));
+    if (unlikely(!bh)) {
+        return;
+    }
 
+    lock_buffer(bh);
     inode = (struct pdfs_inode *)(bh->b_data + PDFS_INODE_BYTE_OFFSET(sb, inode_no));
     memcpy(inode, inode_buf, sizeof(*inode));
 
-    mark_buffer_dirty(bh);
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
 }
 
+/* Double hashing on top of the dcache name hash: bit i of the filter is
+   h1 + i * h2, with h2 forced odd so the probes never collapse */
+static unsigned int pdfs_dir_bloom_bit(u32 hash, unsigned int i) {
+    u32 h2 = hash_32(hash, 32) | 1;
+    return (hash + i * h2) % PDFS_DIR_BLOOM_BITS;
+}
+
+void pdfs_dir_bloom_add(struct pdfs_inode *dir_pdfs_inode,
+                           const char *name, unsigned int len) {
+    struct pdfs_inode_info *info = PDFS_INODE_INFO(dir_pdfs_inode);
+    u32 hash = full_name_hash(name, len);
+    unsigned int i;
+
+    for (i = 0; i < PDFS_DIR_BLOOM_HASHES; i++) {
+        __set_bit(pdfs_dir_bloom_bit(hash, i), info->dir_bloom);
+    }
+}
+
+bool pdfs_dir_bloom_test(struct pdfs_inode *dir_pdfs_inode,
+                            const char *name, unsigned int len) {
+    struct pdfs_inode_info *info = PDFS_INODE_INFO(dir_pdfs_inode);
+    u32 hash = full_name_hash(name, len);
+    unsigned int i;
+
+    for (i = 0; i < PDFS_DIR_BLOOM_HASHES; i++) {
+        if (!test_bit(pdfs_dir_bloom_bit(hash, i), info->dir_bloom)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Populate the Bloom filter of a directory from its (already read)
+   directory block. Callers hold the directory's i_mutex. */
+static void pdfs_dir_bloom_fill(struct pdfs_inode *dir_pdfs_inode,
+                                   struct buffer_head *bh) {
+    struct pdfs_inode_info *info = PDFS_INODE_INFO(dir_pdfs_inode);
+    struct pdfs_dir_record *dir_record;
+    uint64_t i;
+
+    bitmap_zero(info->dir_bloom, PDFS_DIR_BLOOM_BITS);
+    dir_record = (struct pdfs_dir_record *)bh->b_data;
+    for (i = 0; i < dir_pdfs_inode->dir_children_count; i++) {
+        pdfs_dir_bloom_add(dir_pdfs_inode, dir_record->filename,
+                           strlen(dir_record->filename));
+        dir_record++;
+    }
+    info->dir_bloom_valid = true;
+}
+
 int pdfs_add_dir_record(struct super_block *sb, struct inode *dir,
                            struct dentry *dentry, struct inode *inode) {
     struct buffer_head *bh;
@@ -121,40 +361,123 @@ int pdfs_add_dir_record(struct super_block *sb, struct inode *dir,
         return -ENOSPC;
     }
 
-    bh = sb_bread(sb, parent_pdfs_inode->data_block_no);
-    BUG_ON(!bh);
+    bh = pdfs_bread_meta(sb, parent_pdfs_inode->data_block_no);
+    if (unlikely(!bh)) {
+        return -EIO;
+    }
 
+    lock_buffer(bh);
     dir_record = (struct pdfs_dir_record *)bh->b_data;
     dir_record += parent_pdfs_inode->dir_children_count;
-    dir_record->inode_no = inode->i_ino;
+    dir_record->inode_no = PDFS_INODE(inode)->inode_no;
     strcpy(dir_record->filename, dentry->d_name.name);
 
-    mark_buffer_dirty(bh);
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
 
     parent_pdfs_inode->dir_children_count += 1;
     pdfs_save_pdfs_inode(sb, parent_pdfs_inode);
 
+    if (PDFS_INODE_INFO(parent_pdfs_inode)->dir_bloom_valid) {
+        pdfs_dir_bloom_add(parent_pdfs_inode, dentry->d_name.name,
+                           dentry->d_name.len);
+    }
+
+    return 0;
+}
+
+/* Find the record for name in a directory. On success the directory
+   block is returned in *out_bh and must be released by the caller. Returns
+   NULL if there is no such record, or an ERR_PTR if the block is bad. */
+static struct pdfs_dir_record *pdfs_find_dir_record(
+        struct super_block *sb, struct pdfs_inode *dir_pdfs_inode,
+        const char *name, struct buffer_head **out_bh) {
+    struct buffer_head *bh;
+    struct pdfs_dir_record *dir_record;
+    uint64_t i;
+
+    bh = pdfs_bread_meta(sb, dir_pdfs_inode->data_block_no);
+    if (unlikely(!bh)) {
+        return ERR_PTR(-EIO);
+    }
+
+    dir_record = (struct pdfs_dir_record *)bh->b_data;
+    for (i = 0; i < dir_pdfs_inode->dir_children_count; i++) {
+        if (0 == strcmp(dir_record->filename, name)) {
+            *out_bh = bh;
+            return dir_record;
+        }
+        dir_record++;
+    }
+
+    brelse(bh);
+    return NULL;
+}
+
+int pdfs_remove_dir_record(struct super_block *sb, struct inode *dir,
+                              struct dentry *dentry) {
+    struct buffer_head *bh;
+    struct pdfs_inode *parent_pdfs_inode;
+    struct pdfs_dir_record *dir_record;
+    struct pdfs_dir_record *last_record;
+
+    parent_pdfs_inode = PDFS_INODE(dir);
+    dir_record = pdfs_find_dir_record(sb, parent_pdfs_inode,
+                                      dentry->d_name.name, &bh);
+    if (IS_ERR_OR_NULL(dir_record)) {
+        return dir_record ? PTR_ERR(dir_record) : -ENOENT;
+    }
+
+    /* Keep the records dense: move the last record into the hole.
+       The Bloom filter keeps the stale bits, which only costs a
+       false positive. */
+    lock_buffer(bh);
+    last_record = (struct pdfs_dir_record *)bh->b_data;
+    last_record += parent_pdfs_inode->dir_children_count - 1;
+    if (dir_record != last_record) {
+        memcpy(dir_record, last_record, sizeof(*dir_record));
+    }
+    memset(last_record, 0, sizeof(*last_record));
+
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+
+    parent_pdfs_inode->dir_children_count -= 1;
+    pdfs_save_pdfs_inode(sb, parent_pdfs_inode);
+
     return 0;
 }
 
 int pdfs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no) {
+    struct pdfs_sb_info *sbi;
     struct pdfs_superblock *pdfs_sb;
     struct buffer_head *bh;
     uint64_t i;
     int ret;
+    bool retried = false;
     char *bitmap;
     char *slot;
     char needle;
+    u64 start = pdfs_stats_start();
 
+    sbi = PDFS_SB_INFO(sb);
     pdfs_sb = PDFS_SB(sb);
 
+retry:
     mutex_lock(&pdfs_sb_lock);
 
-    bh = sb_bread(sb, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO);
-    BUG_ON(!bh);
+    bh = pdfs_bread_meta(sb, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO);
+    if (unlikely(!bh)) {
+        mutex_unlock(&pdfs_sb_lock);
+        ret = -EIO;
+        goto out;
+    }
 
+    lock_buffer(bh);
     bitmap = bh->b_data;
     ret = -ENOSPC;
     for (i = 0; i < pdfs_sb->data_block_table_size; i++) {
@@ -170,17 +493,329 @@ int pdfs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no) {
         }
     }
 
-    mark_buffer_dirty(bh);
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
     pdfs_save_sb(sb);
 
     mutex_unlock(&pdfs_sb_lock);
+
+    /* Blocks waiting for their discard are still marked in use */
+    if (-ENOSPC == ret && !retried && sbi->discard_pending) {
+        flush_delayed_work(&sbi->discard_work);
+        retried = true;
+        goto retry;
+    }
+
+out:
+    trace_pdfs_alloc_data_block(sb, ret ? 0 : *out_data_block_no, ret);
+    pdfs_stats_end(sb, PDFS_OP_ALLOC_DATA_BLOCK, start, ret);
     return ret;
 }
 
-int pdfs_create_inode(struct inode *dir, struct dentry *dentry,
-                         umode_t mode) {
+/* Clear count data blocks starting at the absolute block number start
+   in the data block bitmap */
+static void pdfs_release_data_blocks(struct super_block *sb,
+                                        uint64_t start, uint64_t count) {
+    struct pdfs_superblock *pdfs_sb;
+    struct buffer_head *bh;
+    uint64_t i;
+    uint64_t offset;
+    char *slot;
+    char needle;
+
+    pdfs_sb = PDFS_SB(sb);
+
+    mutex_lock(&pdfs_sb_lock);
+
+    bh = pdfs_bread_meta(sb, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO);
+    if (unlikely(!bh)) {
+        /* The blocks stay allocated */
+        mutex_unlock(&pdfs_sb_lock);
+        return;
+    }
+
+    lock_buffer(bh);
+    for (i = 0; i < count; i++) {
+        offset = start + i - PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb);
+        slot = bh->b_data + offset / BITS_IN_BYTE;
+        needle = 1 << (offset % BITS_IN_BYTE);
+        if (likely(*slot & needle)) {
+            *slot &= ~needle;
+            pdfs_sb->data_block_count -= 1;
+        } else {
+            printk(KERN_WARNING
+                   "Freeing data block %llu which is not in use\n",
+                   start + i);
+        }
+    }
+
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+    pdfs_save_sb(sb);
+
+    mutex_unlock(&pdfs_sb_lock);
+}
+
+void pdfs_free_data_block(struct super_block *sb, uint64_t data_block_no) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    struct pdfs_free_extent *extent;
+    struct pdfs_free_extent *last;
+    bool merged = false;
+    bool batch_full;
+
+    trace_pdfs_free_data_block(sb, data_block_no, 0);
+
+    if (!(sbi->mount_opts & PDFS_MOUNT_DISCARD)) {
+        pdfs_release_data_blocks(sb, data_block_no, 1);
+        return;
+    }
+
+    extent = kmalloc(sizeof(*extent), GFP_NOFS);
+
+    spin_lock(&sbi->discard_lock);
+    if (!list_empty(&sbi->discard_list)) {
+        last = list_entry(sbi->discard_list.prev,
+                          struct pdfs_free_extent, list);
+        if (last->start + last->count == data_block_no) {
+            last->count += 1;
+            merged = true;
+        } else if (data_block_no + 1 == last->start) {
+            last->start -= 1;
+            last->count += 1;
+            merged = true;
+        }
+    }
+    if (!merged) {
+        if (!extent) {
+            /* No memory to remember it: skip the discard */
+            spin_unlock(&sbi->discard_lock);
+            pdfs_release_data_blocks(sb, data_block_no, 1);
+            return;
+        }
+        extent->start = data_block_no;
+        extent->count = 1;
+        list_add_tail(&extent->list, &sbi->discard_list);
+        extent = NULL;
+    }
+    sbi->discard_pending += 1;
+    batch_full = sbi->discard_pending >= PDFS_DISCARD_BATCH;
+    spin_unlock(&sbi->discard_lock);
+
+    kfree(extent);
+
+    if (batch_full) {
+        mod_delayed_work(system_wq, &sbi->discard_work, 0);
+    } else {
+        queue_delayed_work(system_wq, &sbi->discard_work,
+                           PDFS_DISCARD_DELAY);
+    }
+}
+
+/* Issue the batched discards, then hand the blocks back to the allocator */
+void pdfs_discard_work(struct work_struct *work) {
+    struct pdfs_sb_info *sbi;
+    struct super_block *sb;
+    struct pdfs_free_extent *extent;
+    struct pdfs_free_extent *tmp;
+    LIST_HEAD(batch);
+    int ret;
+
+    sbi = container_of(to_delayed_work(work), struct pdfs_sb_info,
+                       discard_work);
+    sb = sbi->sb;
+
+    spin_lock(&sbi->discard_lock);
+    list_splice_init(&sbi->discard_list, &batch);
+    sbi->discard_pending = 0;
+    spin_unlock(&sbi->discard_lock);
+
+    list_for_each_entry_safe(extent, tmp, &batch, list) {
+        ret = sb_issue_discard(sb, extent->start, extent->count,
+                               GFP_NOFS, 0);
+        if (ret && -EOPNOTSUPP != ret) {
+            printk(KERN_WARNING
+                   "pdfs: discard of blocks %llu-%llu failed: %d\n",
+                   extent->start, extent->start + extent->count - 1, ret);
+        }
+        pdfs_release_data_blocks(sb, extent->start, extent->count);
+        list_del(&extent->list);
+        kfree(extent);
+    }
+}
+
+/* Reserve up to PDFS_DISCARD_BATCH free runs of at least minblocks data
+   blocks, scanning table offsets from *cursor to last. The runs are marked
+   in use in the bitmap, like blocks waiting for an online discard, and
+   added to extents, and *cursor is moved past the scanned range. */
+static int pdfs_reserve_free_runs(struct super_block *sb,
+                                       uint64_t *cursor, uint64_t last,
+                                       uint64_t minblocks,
+                                       struct list_head *extents) {
+    struct pdfs_superblock *pdfs_sb;
+    struct pdfs_free_extent *extent;
+    struct buffer_head *bh;
+    uint64_t table_start;
+    uint64_t i;
+    uint64_t j;
+    uint64_t run_start = 0;
+    uint64_t reserved = 0;
+    unsigned int runs = 0;
+    bool in_run = false;
+    bool is_free;
+    char *bitmap;
+    int ret = 0;
+
+    pdfs_sb = PDFS_SB(sb);
+    table_start = PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb);
+
+    mutex_lock(&pdfs_sb_lock);
+
+    bh = pdfs_bread_meta(sb, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO);
+    if (unlikely(!bh)) {
+        mutex_unlock(&pdfs_sb_lock);
+        return -EIO;
+    }
+    lock_buffer(bh);
+    bitmap = bh->b_data;
+
+    for (i = *cursor; i <= last + 1 && runs < PDFS_DISCARD_BATCH; i++) {
+        is_free = i <= last
+                  && 0 == (bitmap[i / BITS_IN_BYTE]
+                           & (1 << (i % BITS_IN_BYTE)));
+        if (is_free && !in_run) {
+            run_start = i;
+            in_run = true;
+        } else if (!is_free && in_run) {
+            in_run = false;
+            if (i - run_start < minblocks) {
+                continue;
+            }
+            extent = kmalloc(sizeof(*extent), GFP_NOFS);
+            if (!extent) {
+                /* Come back for this run once the batch is done */
+                i = run_start;
+                ret = -ENOMEM;
+                break;
+            }
+            extent->start = table_start + run_start;
+            extent->count = i - run_start;
+            list_add_tail(&extent->list, extents);
+            for (j = run_start; j < i; j++) {
+                bitmap[j / BITS_IN_BYTE] |= 1 << (j % BITS_IN_BYTE);
+            }
+            pdfs_sb->data_block_count += extent->count;
+            reserved += extent->count;
+            runs++;
+        }
+    }
+    *cursor = i;
+
+    if (reserved) {
+        pdfs_mark_meta_dirty(sb, bh);
+    }
+    unlock_buffer(bh);
+    if (reserved) {
+        sync_dirty_buffer(bh);
+        pdfs_save_sb(sb);
+    }
+    brelse(bh);
+
+    mutex_unlock(&pdfs_sb_lock);
+    return ret;
+}
+
+/* FITRIM: discard every run of at least minlen free data blocks inside
+   the given byte range. Runs are reserved in batches under pdfs_sb_lock,
+   so they can't be handed out while they are being discarded, and the
+   lock is dropped for the discards themselves. */
+int pdfs_trim_fs(struct super_block *sb, struct fstrim_range *range) {
+    struct pdfs_superblock *pdfs_sb;
+    struct pdfs_free_extent *extent;
+    struct pdfs_free_extent *tmp;
+    uint64_t table_start;
+    uint64_t first;
+    uint64_t last;
+    uint64_t minblocks;
+    uint64_t cursor;
+    uint64_t trimmed = 0;
+    LIST_HEAD(extents);
+    int ret = 0;
+    int err;
+
+    pdfs_sb = PDFS_SB(sb);
+    table_start = PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb);
+
+    if (range->len < sb->s_blocksize) {
+        return -EINVAL;
+    }
+    first = range->start >> sb->s_blocksize_bits;
+    last = first + (range->len >> sb->s_blocksize_bits) - 1;
+    if (last < first) {
+        last = ULLONG_MAX;
+    }
+    minblocks = max_t(uint64_t, range->minlen >> sb->s_blocksize_bits, 1);
+
+    first = max(first, table_start);
+    last = min(last, table_start + pdfs_sb->data_block_table_size - 1);
+    if (first > last) {
+        range->len = 0;
+        return 0;
+    }
+
+    cursor = first - table_start;
+    while (!ret && cursor <= last - table_start) {
+        err = pdfs_reserve_free_runs(sb, &cursor, last - table_start,
+                                     minblocks, &extents);
+
+        list_for_each_entry_safe(extent, tmp, &extents, list) {
+            if (!ret) {
+                ret = sb_issue_discard(sb, extent->start, extent->count,
+                                       GFP_NOFS, 0);
+                if (!ret) {
+                    trimmed += extent->count;
+                }
+            }
+            pdfs_release_data_blocks(sb, extent->start, extent->count);
+            list_del(&extent->list);
+            kfree(extent);
+        }
+
+        if (!ret) {
+            ret = err;
+        }
+        if (!ret && fatal_signal_pending(current)) {
+            ret = -ERESTARTSYS;
+        }
+    }
+
+    range->len = trimmed << sb->s_blocksize_bits;
+    return ret;
+}
+
+/* A new directory block must carry a valid checksum before it is read */
+static int pdfs_init_dir_block(struct super_block *sb, uint64_t block_no) {
+    struct buffer_head *bh;
+
+    bh = sb_getblk(sb, block_no);
+    if (unlikely(!bh)) {
+        return -ENOMEM;
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, sb->s_blocksize);
+    set_buffer_uptodate(bh);
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
+    sync_dirty_buffer(bh);
+    brelse(bh);
+    return 0;
+}
+
+static int pdfs_do_create_inode(struct inode *dir, struct dentry *dentry,
+                                   umode_t mode) {
     struct super_block *sb;
     struct pdfs_superblock *pdfs_sb;
     uint64_t inode_no;
@@ -191,6 +826,10 @@ int pdfs_create_inode(struct inode *dir, struct dentry *dentry,
     sb = dir->i_sb;
     pdfs_sb = PDFS_SB(sb);
 
+    if (pdfs_inode_in_lower_layer(dir)) {
+        return -EROFS;
+    }
+
     /* Create pdfs_inode */
     ret = pdfs_alloc_pdfs_inode(sb, &inode_no);
     if (0 != ret) {
@@ -198,15 +837,22 @@ int pdfs_create_inode(struct inode *dir, struct dentry *dentry,
                         "Is inode table full? "
                         "Inode count: %llu\n",
                         pdfs_sb->inode_count);
-        return -ENOSPC;
+        return ret;
+    }
+    pdfs_inode = pdfs_alloc_inode_buf(sb);
+    if (!pdfs_inode) {
+        pdfs_free_pdfs_inode(sb, inode_no);
+        return -ENOMEM;
     }
-    pdfs_inode = kmem_cache_alloc(pdfs_inode_cache, GFP_KERNEL);
     pdfs_inode->inode_no = inode_no;
     pdfs_inode->mode = mode;
+    pdfs_inode->flags = 0;
     if (S_ISDIR(mode)) {
         pdfs_inode->dir_children_count = 0;
     } else if (S_ISREG(mode)) {
         pdfs_inode->file_size = 0;
+        /* The first write needn't read back what a freed file left */
+        pdfs_inode->flags |= PDFS_INODE_FL_UNWRITTEN;
     } else {
         printk(KERN_WARNING
                "Inode %llu is neither a directory nor a regular file",
@@ -220,32 +866,63 @@ int pdfs_create_inode(struct inode *dir, struct dentry *dentry,
                         "Is data block table full? "
                         "Data block count: %llu\n",
                         pdfs_sb->data_block_count);
-        return -ENOSPC;
+        pdfs_free_inode_buf(pdfs_inode);
+        pdfs_free_pdfs_inode(sb, inode_no);
+        return ret;
+    }
+    if (S_ISDIR(mode)) {
+        ret = pdfs_init_dir_block(sb, pdfs_inode->data_block_no);
+        if (0 != ret) {
+            pdfs_free_data_block(sb, pdfs_inode->data_block_no);
+            pdfs_free_inode_buf(pdfs_inode);
+            pdfs_free_pdfs_inode(sb, inode_no);
+            return ret;
+        }
     }
 
     /* Create VFS inode */
     inode = new_inode(sb);
     if (!inode) {
+        pdfs_free_data_block(sb, pdfs_inode->data_block_no);
+        pdfs_free_inode_buf(pdfs_inode);
+        pdfs_free_pdfs_inode(sb, inode_no);
         return -ENOMEM;
     }
     pdfs_fill_inode(sb, inode, pdfs_inode);
 
+    /* The slot may hold a previously freed inode, so write it out now */
+    pdfs_save_pdfs_inode(sb, pdfs_inode);
+
     /* Add new inode to parent dir */
     ret = pdfs_add_dir_record(sb, dir, dentry, inode);
     if (0 != ret) {
         printk(KERN_ERR "Failed to add inode %lu to parent dir %lu\n",
                inode->i_ino, dir->i_ino);
-        return -ENOSPC;
+        /* Unlinked, so evicting it frees its data block and inode */
+        clear_nlink(inode);
+        iput(inode);
+        return ret;
     }
 
     inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
-
-    /* TODO we should free newly allocated inodes when error occurs */
+    /* dentry may be a negative dentry hashed by pdfs_lookup */
+    d_instantiate(dentry, inode);
 
     return 0;
 }
 
+int pdfs_create_inode(struct inode *dir, struct dentry *dentry,
+                         umode_t mode) {
+    u64 start = pdfs_stats_start();
+    int ret;
+
+    ret = pdfs_do_create_inode(dir, dentry, mode);
+
+    trace_pdfs_create_inode(dir, dentry, mode, ret);
+    pdfs_stats_end(dir->i_sb, PDFS_OP_CREATE, start, ret);
+    return ret;
+}
+
 int pdfs_create(struct inode *dir, struct dentry *dentry,
                    umode_t mode, bool excl) {
     return pdfs_create_inode(dir, dentry, mode);
@@ -259,41 +936,284 @@ int pdfs_mkdir(struct inode *dir, struct dentry *dentry,
     return pdfs_create_inode(dir, dentry, mode);
 }
 
-struct dentry *pdfs_lookup(struct inode *dir,
-                              struct dentry *child_dentry,
-                              unsigned int flags) {
-    struct pdfs_inode *parent_pdfs_inode = PDFS_INODE(dir);
-    struct super_block *sb = dir->i_sb;
+/* Look a name up in one layer's copy of a directory. The Bloom filter
+   answers most misses without reading the directory block. */
+int pdfs_dir_find_inode_no(struct super_block *sb,
+                              struct pdfs_inode *dir_pdfs_inode,
+                              const char *name, unsigned int len,
+                              uint64_t *out_inode_no) {
     struct buffer_head *bh;
     struct pdfs_dir_record *dir_record;
-    struct pdfs_inode *pdfs_child_inode;
-    struct inode *child_inode;
     uint64_t i;
 
-    bh = sb_bread(sb, parent_pdfs_inode->data_block_no);
-    BUG_ON(!bh);
+    if (PDFS_INODE_INFO(dir_pdfs_inode)->dir_bloom_valid
+            && !pdfs_dir_bloom_test(dir_pdfs_inode, name, len)) {
+        return -ENOENT;
+    }
+
+    bh = pdfs_bread_meta(sb, dir_pdfs_inode->data_block_no);
+    if (unlikely(!bh)) {
+        return -EIO;
+    }
+
+    if (!PDFS_INODE_INFO(dir_pdfs_inode)->dir_bloom_valid) {
+        pdfs_dir_bloom_fill(dir_pdfs_inode, bh);
+    }
 
     dir_record = (struct pdfs_dir_record *)bh->b_data;
 
-    for (i = 0; i < parent_pdfs_inode->dir_children_count; i++) {
-        printk(KERN_INFO "pdfs_lookup: i=%llu, dir_record->filename=%s, child_dentry->d_name.name=%s", i, dir_record->filename, child_dentry->d_name.name);    // TODO
-        if (0 == strcmp(dir_record->filename, child_dentry->d_name.name)) {
-            pdfs_child_inode = pdfs_get_pdfs_inode(sb, dir_record->inode_no);
-            child_inode = new_inode(sb);
-            if (!child_inode) {
-                printk(KERN_ERR "Cannot create new inode. No memory.\n");
-                return NULL; 
-            }
-            pdfs_fill_inode(sb, child_inode, pdfs_child_inode);
-            inode_init_owner(child_inode, dir, pdfs_child_inode->mode);
-            d_add(child_dentry, child_inode);
-            return NULL;    
+    for (i = 0; i < dir_pdfs_inode->dir_children_count; i++) {
+        if (0 == strcmp(dir_record->filename, name)) {
+            *out_inode_no = dir_record->inode_no;
+            brelse(bh);
+            return 0;
         }
         dir_record++;
     }
+    brelse(bh);
+
+    return -ENOENT;
+}
+
+/* Lookups walk the layers of the parent directory from the top. The first
+   hit wins; when it is a directory, directories of the same name in the
+   layers below are merged into it. The result is cached with the inode of
+   the child dentry. */
+static struct dentry *pdfs_do_lookup(struct inode *dir,
+                                        struct dentry *child_dentry) {
+    struct pdfs_inode *parent_pdfs_inode = PDFS_INODE(dir);
+    struct super_block *sb = dir->i_sb;
+    struct pdfs_inode *layer_dir;
+    struct super_block *layer_sb;
+    struct pdfs_inode *pdfs_found_inode;
+    struct pdfs_inode *pdfs_child_inode = NULL;
+    struct inode *child_inode;
+    unsigned int nr_layers;
+    unsigned int i;
+    uint64_t inode_no;
+    int ret = 0;
+
+    if (unlikely(child_dentry->d_name.len >= PDFS_FILENAME_MAXLEN)) {
+        return ERR_PTR(-ENAMETOOLONG);
+    }
+
+    nr_layers = pdfs_dir_layer_count(parent_pdfs_inode);
+    for (i = 0; i < nr_layers; i++) {
+        layer_dir = pdfs_dir_layer(parent_pdfs_inode, i);
+        layer_sb = PDFS_INODE_INFO(layer_dir)->layer_sb;
+        ret = pdfs_dir_find_inode_no(layer_sb, layer_dir,
+                                     child_dentry->d_name.name,
+                                     child_dentry->d_name.len,
+                                     &inode_no);
+        if (-ENOENT == ret) {
+            ret = 0;
+            continue;
+        }
+        if (ret) {
+            break;
+        }
+
+        pdfs_found_inode = pdfs_get_pdfs_inode(layer_sb, inode_no);
+        if (IS_ERR(pdfs_found_inode)) {
+            ret = PTR_ERR(pdfs_found_inode);
+            break;
+        }
+        if (!pdfs_child_inode) {
+            pdfs_child_inode = pdfs_found_inode;
+            if (!S_ISDIR(pdfs_child_inode->mode)) {
+                break;
+            }
+        } else if (S_ISDIR(pdfs_found_inode->mode)) {
+            ret = pdfs_add_lower_dir(pdfs_child_inode, pdfs_found_inode);
+            if (ret) {
+                pdfs_free_inode_buf(pdfs_found_inode);
+                break;
+            }
+        } else {
+            /* Shadowed by the directory above */
+            pdfs_free_inode_buf(pdfs_found_inode);
+        }
+    }
+
+    if (ret) {
+        if (pdfs_child_inode) {
+            pdfs_free_inode_buf(pdfs_child_inode);
+        }
+        return ERR_PTR(ret);
+    }
 
-    printk(KERN_ERR
-           "No inode found for the filename: %s\n",
-           child_dentry->d_name.name);
+    if (!pdfs_child_inode) {
+        /* Cache the miss so repeated probes are answered by the dcache */
+        d_add(child_dentry, NULL);
+        return NULL;
+    }
+
+    child_inode = new_inode(sb);
+    if (!child_inode) {
+        printk(KERN_ERR "Cannot create new inode. No memory.\n");
+        pdfs_free_inode_buf(pdfs_child_inode);
+        return ERR_PTR(-ENOMEM);
+    }
+    PDFS_INODE_INFO(pdfs_child_inode)->layer
+        = pdfs_layer_index(sb, PDFS_INODE_INFO(pdfs_child_inode)->layer_sb);
+    pdfs_fill_inode(sb, child_inode, pdfs_child_inode);
+    inode_init_owner(child_inode, dir, pdfs_child_inode->mode);
+    d_add(child_dentry, child_inode);
     return NULL;
 }
+
+struct dentry *pdfs_lookup(struct inode *dir,
+                              struct dentry *child_dentry,
+                              unsigned int flags) {
+    u64 start = pdfs_stats_start();
+    struct dentry *ret;
+
+    ret = pdfs_do_lookup(dir, child_dentry);
+
+    trace_pdfs_lookup(dir, child_dentry,
+                      !IS_ERR(ret) && child_dentry->d_inode);
+    pdfs_stats_end(dir->i_sb, PDFS_OP_LOOKUP, start,
+                   IS_ERR(ret) ? PTR_ERR(ret) : 0);
+    return ret;
+}
+
+/* Removing a name that a lower layer also has would need a whiteout */
+static bool pdfs_name_in_lower_layers(struct inode *dir,
+                                         struct dentry *dentry) {
+    struct pdfs_inode *dir_pdfs_inode = PDFS_INODE(dir);
+    struct pdfs_inode *layer_dir;
+    unsigned int i;
+    uint64_t inode_no;
+
+    for (i = 1; i < pdfs_dir_layer_count(dir_pdfs_inode); i++) {
+        layer_dir = pdfs_dir_layer(dir_pdfs_inode, i);
+        if (0 == pdfs_dir_find_inode_no(PDFS_INODE_INFO(layer_dir)->layer_sb,
+                                        layer_dir, dentry->d_name.name,
+                                        dentry->d_name.len, &inode_no)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+int pdfs_unlink(struct inode *dir, struct dentry *dentry) {
+    struct super_block *sb = dir->i_sb;
+    struct inode *inode = dentry->d_inode;
+    int ret;
+
+    if (pdfs_inode_in_lower_layer(dir) || pdfs_inode_in_lower_layer(inode)
+            || pdfs_name_in_lower_layers(dir, dentry)) {
+        return -EROFS;
+    }
+
+    ret = pdfs_remove_dir_record(sb, dir, dentry);
+    if (0 != ret) {
+        return ret;
+    }
+
+    dir->i_ctime = dir->i_mtime = inode->i_ctime = CURRENT_TIME;
+    /* The last iput of the inode frees it in pdfs_evict_inode */
+    drop_nlink(inode);
+    return 0;
+}
+
+/* A merged directory is empty only if it is in every layer it spans;
+   removing it would otherwise expose or orphan the lower entries */
+static bool pdfs_dir_is_empty(struct pdfs_inode *dir_pdfs_inode) {
+    unsigned int i;
+
+    for (i = 0; i < pdfs_dir_layer_count(dir_pdfs_inode); i++) {
+        if (pdfs_dir_layer(dir_pdfs_inode, i)->dir_children_count) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int pdfs_rmdir(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = dentry->d_inode;
+
+    if (!pdfs_dir_is_empty(PDFS_INODE(inode))) {
+        return -ENOTEMPTY;
+    }
+    return pdfs_unlink(dir, dentry);
+}
+
+int pdfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+                   struct inode *new_dir, struct dentry *new_dentry) {
+    struct super_block *sb = old_dir->i_sb;
+    struct inode *old_inode = old_dentry->d_inode;
+    struct inode *new_inode = new_dentry->d_inode;
+    struct pdfs_inode *new_dir_pdfs_inode = PDFS_INODE(new_dir);
+    struct buffer_head *bh;
+    struct pdfs_dir_record *dir_record;
+    int ret;
+
+    if (pdfs_inode_in_lower_layer(old_dir)
+            || pdfs_inode_in_lower_layer(new_dir)
+            || pdfs_inode_in_lower_layer(old_inode)
+            || (new_inode && pdfs_inode_in_lower_layer(new_inode))
+            || pdfs_name_in_lower_layers(old_dir, old_dentry)) {
+        return -EROFS;
+    }
+
+    if (new_inode) {
+        if (S_ISDIR(new_inode->i_mode)
+                && !pdfs_dir_is_empty(PDFS_INODE(new_inode))) {
+            return -ENOTEMPTY;
+        }
+
+        /* Point the target's record at the renamed inode */
+        dir_record = pdfs_find_dir_record(sb, new_dir_pdfs_inode,
+                                          new_dentry->d_name.name, &bh);
+        if (IS_ERR_OR_NULL(dir_record)) {
+            return dir_record ? PTR_ERR(dir_record) : -ENOENT;
+        }
+        lock_buffer(bh);
+        dir_record->inode_no = PDFS_INODE(old_inode)->inode_no;
+        pdfs_mark_meta_dirty(sb, bh);
+        unlock_buffer(bh);
+        sync_dirty_buffer(bh);
+        brelse(bh);
+
+        ret = pdfs_remove_dir_record(sb, old_dir, old_dentry);
+        if (0 != ret) {
+            return ret;
+        }
+
+        new_inode->i_ctime = CURRENT_TIME;
+        drop_nlink(new_inode);
+    } else if (old_dir == new_dir) {
+        /* Rename the record in place, even if the directory block is full */
+        dir_record = pdfs_find_dir_record(sb, new_dir_pdfs_inode,
+                                          old_dentry->d_name.name, &bh);
+        if (IS_ERR_OR_NULL(dir_record)) {
+            return dir_record ? PTR_ERR(dir_record) : -ENOENT;
+        }
+        lock_buffer(bh);
+        strcpy(dir_record->filename, new_dentry->d_name.name);
+        pdfs_mark_meta_dirty(sb, bh);
+        unlock_buffer(bh);
+        sync_dirty_buffer(bh);
+        brelse(bh);
+
+        if (PDFS_INODE_INFO(new_dir_pdfs_inode)->dir_bloom_valid) {
+            pdfs_dir_bloom_add(new_dir_pdfs_inode, new_dentry->d_name.name,
+                               new_dentry->d_name.len);
+        }
+    } else {
+        ret = pdfs_add_dir_record(sb, new_dir, new_dentry, old_inode);
+        if (0 != ret) {
+            return ret;
+        }
+        ret = pdfs_remove_dir_record(sb, old_dir, old_dentry);
+        if (0 != ret) {
+            return ret;
+        }
+    }
+
+    old_dir->i_ctime = old_dir->i_mtime = CURRENT_TIME;
+    new_dir->i_ctime = new_dir->i_mtime = CURRENT_TIME;
+    old_inode->i_ctime = CURRENT_TIME;
+    return 0;
+}
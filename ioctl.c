@@ -0,0 +1,117 @@
+#include "kpdfs.h"
+
+static long pdfs_ioctl_fitrim(struct super_block *sb, unsigned long arg) {
+    struct request_queue *q = bdev_get_queue(sb->s_bdev);
+    struct fstrim_range range;
+    int ret;
+
+    if (!capable(CAP_SYS_ADMIN)) {
+        return -EPERM;
+    }
+    if (!blk_queue_discard(q)) {
+        return -EOPNOTSUPP;
+    }
+    if (copy_from_user(&range, (struct fstrim_range __user *)arg,
+                       sizeof(range))) {
+        return -EFAULT;
+    }
+
+    range.minlen = max_t(uint64_t, range.minlen,
+                         q->limits.discard_granularity);
+    ret = pdfs_trim_fs(sb, &range);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (copy_to_user((struct fstrim_range __user *)arg, &range,
+                     sizeof(range))) {
+        return -EFAULT;
+    }
+    return 0;
+}
+
+/* The checks rw_verify_area() makes before a read or write, which the
+   copy_file_range() system call makes too. rw_verify_area() itself isn't
+   exported to modules. */
+static int pdfs_verify_area(int read_write, struct file *file,
+                               loff_t pos, size_t count) {
+    struct inode *inode = file->f_path.dentry->d_inode;
+    int ret;
+
+    if ((ssize_t)count < 0 || pos < 0 || pos + (loff_t)count < pos) {
+        return -EINVAL;
+    }
+    if (inode->i_flock && mandatory_lock(inode)) {
+        ret = locks_mandatory_area(read_write == READ ? FLOCK_VERIFY_READ
+                                                      : FLOCK_VERIFY_WRITE,
+                                   inode, file, pos, count);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return security_file_permission(file, read_write == READ ? MAY_READ
+                                                              : MAY_WRITE);
+}
+
+static long pdfs_ioctl_copy_range(struct file *filp, unsigned long arg) {
+    struct pdfs_copy_range_args args;
+    struct fd src;
+    long ret;
+
+    if (copy_from_user(&args, (struct pdfs_copy_range_args __user *)arg,
+                       sizeof(args))) {
+        return -EFAULT;
+    }
+    if (!(filp->f_mode & FMODE_WRITE) || (filp->f_flags & O_APPEND)) {
+        return -EBADF;
+    }
+
+    src = fdget(args.src_fd);
+    if (!src.file) {
+        return -EBADF;
+    }
+    if (!(src.file->f_mode & FMODE_READ)) {
+        ret = -EBADF;
+        goto out;
+    }
+    ret = pdfs_verify_area(READ, src.file, args.src_offset,
+                           args.src_length);
+    if (0 == ret) {
+        ret = pdfs_verify_area(WRITE, filp, args.dest_offset,
+                               args.src_length);
+    }
+    if (0 == ret) {
+        ret = pdfs_copy_range(src.file, args.src_offset, filp,
+                              args.dest_offset, args.src_length);
+    }
+out:
+    fdput(src);
+    return ret;
+}
+
+/* FS_COMPR_FL, i.e. chattr +c, is the only inode flag pdfs has. Only
+   pdfs-fuse sets it and compresses; the module just reports it. */
+static long pdfs_ioctl_getflags(struct inode *inode, unsigned long arg) {
+    int flags = 0;
+
+    if (PDFS_INODE(inode)->flags & PDFS_INODE_FL_COMPRESS) {
+        flags |= FS_COMPR_FL;
+    }
+    return put_user(flags, (int __user *)arg);
+}
+
+long pdfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) {
+    struct inode *inode = filp->f_path.dentry->d_inode;
+    struct super_block *sb = inode->i_sb;
+
+    switch (cmd) {
+    case FITRIM:
+        return pdfs_ioctl_fitrim(sb, arg);
+    case PDFS_IOC_COPY_RANGE:
+        return pdfs_ioctl_copy_range(filp, arg);
+    case FS_IOC_GETFLAGS:
+        return pdfs_ioctl_getflags(inode, arg);
+    default:
+        return -ENOTTY;
+    }
+}
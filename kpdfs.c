@@ -1,5 +1,8 @@
 #include "kpdfs.h"
 
+#define CREATE_TRACE_POINTS
+#include "kpdfs_trace.h"
+
 DEFINE_MUTEX(pdfs_sb_lock);
 
 struct file_system_type pdfs_fs_type = {
@@ -12,23 +15,37 @@ struct file_system_type pdfs_fs_type = {
 
 const struct super_operations pdfs_sb_ops = {
     .destroy_inode = pdfs_destroy_inode,
+    .evict_inode = pdfs_evict_inode,
     .put_super = pdfs_put_super,
+    .remount_fs = pdfs_remount,
+    .show_options = pdfs_show_options,
 };
 
 const struct inode_operations pdfs_inode_ops = {
     .create = pdfs_create,
     .mkdir = pdfs_mkdir,
     .lookup = pdfs_lookup,
+    .unlink = pdfs_unlink,
+    .rmdir = pdfs_rmdir,
+    .rename = pdfs_rename,
+    .setattr = pdfs_setattr,
 };
 
 const struct file_operations pdfs_dir_operations = {
     .owner = THIS_MODULE,
     .readdir = pdfs_readdir,
+    .unlocked_ioctl = pdfs_ioctl,
 };
 
 const struct file_operations pdfs_file_operations = {
+    .open = pdfs_file_open,
     .read = pdfs_read,
     .write = pdfs_write,
+    .fallocate = pdfs_fallocate,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+    .copy_file_range = pdfs_copy_file_range,
+#endif
+    .unlocked_ioctl = pdfs_ioctl,
 };
 
 struct kmem_cache *pdfs_inode_cache = NULL;
@@ -38,7 +55,7 @@ static int __init pdfs_init(void)
     int ret;
 
     pdfs_inode_cache = kmem_cache_create("pdfs_inode_cache",
-                                         sizeof(struct pdfs_inode),
+                                         sizeof(struct pdfs_inode_info),
                                          0,
                                          (SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD),
                                          NULL);
@@ -46,11 +63,19 @@ static int __init pdfs_init(void)
         return -ENOMEM;
     }
 
+    ret = pdfs_sysfs_init();
+    if (ret) {
+        kmem_cache_destroy(pdfs_inode_cache);
+        return ret;
+    }
+
     ret = register_filesystem(&pdfs_fs_type);
     if (likely(0 == ret)) {
         printk(KERN_INFO "Sucessfully registered pdfs\n");
     } else {
         printk(KERN_ERR "Failed to register pdfs. Error code: %d\n", ret);
+        pdfs_sysfs_exit();
+        kmem_cache_destroy(pdfs_inode_cache);
     }
 
     return ret;
@@ -61,6 +86,7 @@ static void __exit pdfs_exit(void)
     int ret;
 
     ret = unregister_filesystem(&pdfs_fs_type);
+    pdfs_sysfs_exit();
     kmem_cache_destroy(pdfs_inode_cache);
 
     if (likely(ret == 0)) {
@@ -5,15 +5,26 @@
 
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/completion.h>
+#include <linux/crc32c.h>
+#include <linux/falloc.h>
+#include <linux/file.h>
 #include <linux/fs.h>
+#include <linux/hash.h>
 #include <linux/init.h>
+#include <linux/kobject.h>
+#include <linux/ktime.h>
 #include <linux/namei.h>
 #include <linux/module.h>
 #include <linux/parser.h>
+#include <linux/percpu.h>
 #include <linux/random.h>
+#include <linux/security.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
 #include <linux/time.h>
 #include <linux/version.h>
+#include <linux/workqueue.h>
 
 #include "pdfs.h"
 
@@ -31,7 +42,10 @@ struct dentry *pdfs_mount(struct file_system_type *fs_type,
 void pdfs_kill_superblock(struct super_block *sb);
 
 void pdfs_destroy_inode(struct inode *inode);
+void pdfs_evict_inode(struct inode *inode);
 void pdfs_put_super(struct super_block *sb);
+int pdfs_remount(struct super_block *sb, int *flags, char *data);
+int pdfs_show_options(struct seq_file *seq, struct dentry *root);
 
 int pdfs_create(struct inode *dir, struct dentry *dentry,
                     umode_t mode, bool excl);
@@ -40,26 +54,197 @@ struct dentry *pdfs_lookup(struct inode *parent_inode,
                                unsigned int flags);
 int pdfs_mkdir(struct inode *dir, struct dentry *dentry,
                    umode_t mode);
+int pdfs_unlink(struct inode *dir, struct dentry *dentry);
+int pdfs_rmdir(struct inode *dir, struct dentry *dentry);
+int pdfs_rename(struct inode *old_dir, struct dentry *old_dentry,
+                   struct inode *new_dir, struct dentry *new_dentry);
+int pdfs_setattr(struct dentry *dentry, struct iattr *attr);
 
 int pdfs_readdir(struct file *filp, void *dirent, filldir_t filldir);
 
+int pdfs_file_open(struct inode *inode, struct file *filp);
 ssize_t pdfs_read(struct file * filp, char __user * buf, size_t len,
                       loff_t * ppos);
 ssize_t pdfs_write(struct file * filp, const char __user * buf, size_t len,
                        loff_t * ppos);
+long pdfs_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
+ssize_t pdfs_copy_range(struct file *file_in, loff_t pos_in,
+                           struct file *file_out, loff_t pos_out,
+                           size_t len);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+ssize_t pdfs_copy_file_range(struct file *file_in, loff_t pos_in,
+                                struct file *file_out, loff_t pos_out,
+                                size_t len, unsigned int flags);
+#endif
+
+long pdfs_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
 
 extern struct kmem_cache *pdfs_inode_cache;
 
+/* Per-operation statistics, exported under /sys/fs/pdfs/<dev>/ */
+
+enum pdfs_op {
+    PDFS_OP_LOOKUP,
+    PDFS_OP_CREATE,
+    PDFS_OP_ALLOC_INODE,
+    PDFS_OP_ALLOC_DATA_BLOCK,
+    PDFS_OP_READ,
+    PDFS_OP_WRITE,
+    PDFS_OP_SAVE_SB,
+    PDFS_OP_NR
+};
+
+// Bucket i of a latency histogram counts operations that took
+// [2^i, 2^(i+1)) ns, the last bucket everything slower
+#define PDFS_LATENCY_BUCKETS 32
+
+// Kept per CPU so the hot paths never share a cache line; sysfs sums them
+struct pdfs_op_stats {
+    u64 count[PDFS_OP_NR];
+    u64 errors[PDFS_OP_NR];
+    u64 latency_ns[PDFS_OP_NR];
+    u64 latency_hist[PDFS_OP_NR][PDFS_LATENCY_BUCKETS];
+};
+
+/* Buffer state bits private to pdfs */
+
+enum pdfs_bh_state_bits {
+    // The checksum of the metadata block in the buffer has been checked
+    // since it was read, or pdfs wrote the block itself
+    BH_PDFS_Verified = BH_PrivateStart,
+};
+
+BUFFER_FNS(PDFS_Verified, pdfs_verified)
+
+/* In-memory superblock state */
+
+// Mount options
+#define PDFS_MOUNT_DISCARD 0x1
+#define PDFS_MOUNT_PREFETCH 0x2
+
+// Inode-table blocks read ahead of a cache miss, the missed one included
+#define PDFS_INODE_READAHEAD_BLOCKS 4
+// -o prefetch reads directory blocks down to this many levels below the root
+#define PDFS_PREFETCH_DEPTH 3
+
+// Freed data blocks are handed to the device in batches of this many blocks,
+// or after PDFS_DISCARD_DELAY jiffies, whichever comes first
+#define PDFS_DISCARD_BATCH 64
+#define PDFS_DISCARD_DELAY HZ
+
+// A run of freed data blocks, as absolute block numbers
+struct pdfs_free_extent {
+    struct list_head list;
+    uint64_t start;
+    uint64_t count;
+};
+
+// A volume and its flattened lower-volume DAG. Inode numbers of lower
+// layers are tagged with the layer index above this shift so that st_ino
+// stays unique across the stack.
+#define PDFS_MAX_LAYERS 8
+#define PDFS_LAYER_INO_SHIFT (BITS_PER_LONG - 4)
+
+struct pdfs_sb_info {
+    struct super_block *sb;
+
+    // In-memory copy of the on-disk superblock, written back by pdfs_save_sb
+    struct pdfs_superblock pdfs_sb;
+    unsigned long mount_opts;
+
+    // With -o discard, freed data blocks stay allocated in the bitmap until
+    // their discard has been issued, so they can't be reused underneath it
+    spinlock_t discard_lock;
+    struct list_head discard_list;
+    uint64_t discard_pending;
+    struct delayed_work discard_work;
+
+    // With -o prefetch, reads the bitmaps, the inode table and the top
+    // directory blocks into the buffer cache after mount
+    struct work_struct prefetch_work;
+
+    // Entry in the list of mounted volumes, searched by volume_id
+    struct list_head volume_list;
+    // Direct lower volumes, pinned with an active reference
+    unsigned int lower_count;
+    // Upper volumes that have this one among their direct lower volumes.
+    // Their cached view of it goes stale if it is written, so it can't be
+    // remounted read-write while this is nonzero.
+    atomic_t upper_count;
+    struct super_block *lowers[PDFS_MAX_LOWER_VOLUMES];
+    // This volume first, then every volume below it in lookup order,
+    // each appearing once
+    unsigned int layer_count;
+    struct super_block *layers[PDFS_MAX_LAYERS];
+
+    struct pdfs_op_stats __percpu *stats;
+    // /sys/fs/pdfs/<dev>/
+    struct kobject s_kobj;
+    struct completion s_kobj_unregister;
+};
+
+/* In-memory inode state */
+
+// A directory block holds at most PDFS_DIR_MAX_RECORD entries, so a small
+// filter with a few hash functions keeps the false positive rate low
+#define PDFS_DIR_BLOOM_BITS 256
+#define PDFS_DIR_BLOOM_HASHES 3
+
+// The same directory in the layers below the one holding the inode
+struct pdfs_lower_dirs {
+    unsigned int count;
+    struct pdfs_inode *dirs[PDFS_MAX_LAYERS - 1];
+};
+
+// pdfs_inode_cache objects are pdfs_inode_info. The on-disk pdfs_inode
+// must stay the first member so that i_private can keep pointing at it.
+struct pdfs_inode_info {
+    struct pdfs_inode pdfs_inode;
+
+    // Volume whose blocks hold this inode, and its index in the layers of
+    // the mounted volume. Resolved once by lookup, so later accesses through
+    // the dentry never walk the layer stack again.
+    struct super_block *layer_sb;
+    unsigned int layer;
+    // Directories only: lower layers merged into this directory, or NULL
+    struct pdfs_lower_dirs *lower_dirs;
+
+    // Bloom filter over the names in the directory block, built on the
+    // first lookup and kept up to date by pdfs_add_dir_record. Lookup misses
+    // that the filter rules out never read the directory block.
+    bool dir_bloom_valid;
+    unsigned long dir_bloom[BITS_TO_LONGS(PDFS_DIR_BLOOM_BITS)];
+};
+
 /* Helper functions */
 
 // To translate VFS superblock to pdfs superblock
-static inline struct pdfs_superblock *PDFS_SB(struct super_block *sb) {
+static inline struct pdfs_sb_info *PDFS_SB_INFO(struct super_block *sb) {
     return sb->s_fs_info;
 }
+static inline struct pdfs_superblock *PDFS_SB(struct super_block *sb) {
+    return &PDFS_SB_INFO(sb)->pdfs_sb;
+}
 static inline struct pdfs_inode *PDFS_INODE(struct inode *inode) {
     return inode->i_private;
 }
 
+static inline struct pdfs_inode_info *PDFS_INODE_INFO(
+        struct pdfs_inode *pdfs_inode) {
+    return container_of(pdfs_inode, struct pdfs_inode_info, pdfs_inode);
+}
+
+// Superblock to read an inode's blocks from; differs from inode->i_sb for
+// inodes found in a lower volume
+static inline struct super_block *PDFS_INODE_SB(struct inode *inode) {
+    return PDFS_INODE_INFO(PDFS_INODE(inode))->layer_sb;
+}
+
+// Lower volumes are read-only: there is no copy-up into the upper volume
+static inline bool pdfs_inode_in_lower_layer(struct inode *inode) {
+    return PDFS_INODE_SB(inode) != inode->i_sb;
+}
+
 static inline uint64_t PDFS_INODES_PER_BLOCK(struct super_block *sb) {
     struct pdfs_superblock *pdfs_sb;
     pdfs_sb = PDFS_SB(sb);
@@ -81,7 +266,7 @@ static inline uint64_t PDFS_INODE_BYTE_OFFSET(struct super_block *sb, uint64_t i
 static inline uint64_t PDFS_DIR_MAX_RECORD(struct super_block *sb) {
     struct pdfs_superblock *pdfs_sb;
     pdfs_sb = PDFS_SB(sb);
-    return pdfs_sb->blocksize / sizeof(struct pdfs_dir_record);
+    return PDFS_DIR_MAX_RECORD_HSB(pdfs_sb);
 }
 
 // From which block does data blocks start
@@ -93,17 +278,63 @@ static inline uint64_t PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO(struct super_block *
 
 void pdfs_save_sb(struct super_block *sb);
 
+// checksummed metadata blocks
+int pdfs_verify_meta(struct super_block *sb, struct buffer_head *bh);
+struct buffer_head *pdfs_bread_meta(struct super_block *sb,
+                                       uint64_t block_no);
+void pdfs_mark_meta_dirty(struct super_block *sb, struct buffer_head *bh);
+
+// statistics and sysfs
+static inline u64 pdfs_stats_start(void) {
+    return ktime_to_ns(ktime_get());
+}
+void pdfs_stats_end(struct super_block *sb, enum pdfs_op op,
+                       u64 start_ns, long ret);
+int pdfs_sysfs_init(void);
+void pdfs_sysfs_exit(void);
+int pdfs_sysfs_register(struct super_block *sb);
+void pdfs_sysfs_unregister(struct super_block *sb);
+
+// files stored compressed by pdfs-fuse, which the module only reads
+ssize_t pdfs_read_compressed(struct super_block *sb,
+                                struct pdfs_inode *pdfs_inode,
+                                char __user *buf, size_t nbytes,
+                                loff_t *ppos);
+
 // functions to operate inode
 void pdfs_fill_inode(struct super_block *sb, struct inode *inode,
                         struct pdfs_inode *pdfs_inode);
 int pdfs_alloc_pdfs_inode(struct super_block *sb, uint64_t *out_inode_no);
 struct pdfs_inode *pdfs_get_pdfs_inode(struct super_block *sb,
                                                 uint64_t inode_no);
+void pdfs_prefetch_work(struct work_struct *work);
 void pdfs_save_pdfs_inode(struct super_block *sb,
                                 struct pdfs_inode *inode);
+void pdfs_free_inode_buf(struct pdfs_inode *pdfs_inode);
+int pdfs_add_lower_dir(struct pdfs_inode *dir_pdfs_inode,
+                          struct pdfs_inode *lower_dir_pdfs_inode);
+unsigned int pdfs_dir_layer_count(struct pdfs_inode *dir_pdfs_inode);
+struct pdfs_inode *pdfs_dir_layer(struct pdfs_inode *dir_pdfs_inode,
+                                     unsigned int i);
+unsigned int pdfs_layer_index(struct super_block *sb,
+                                 struct super_block *layer_sb);
+int pdfs_dir_find_inode_no(struct super_block *sb,
+                              struct pdfs_inode *dir_pdfs_inode,
+                              const char *name, unsigned int len,
+                              uint64_t *out_inode_no);
+void pdfs_dir_bloom_add(struct pdfs_inode *dir_pdfs_inode,
+                           const char *name, unsigned int len);
+bool pdfs_dir_bloom_test(struct pdfs_inode *dir_pdfs_inode,
+                            const char *name, unsigned int len);
 int pdfs_add_dir_record(struct super_block *sb, struct inode *dir,
                            struct dentry *dentry, struct inode *inode);
+void pdfs_free_pdfs_inode(struct super_block *sb, uint64_t inode_no);
+int pdfs_remove_dir_record(struct super_block *sb, struct inode *dir,
+                              struct dentry *dentry);
 int pdfs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no);
+void pdfs_free_data_block(struct super_block *sb, uint64_t data_block_no);
+void pdfs_discard_work(struct work_struct *work);
+int pdfs_trim_fs(struct super_block *sb, struct fstrim_range *range);
 int pdfs_create_inode(struct inode *dir, struct dentry *dentry,
                          umode_t mode);
 
@@ -0,0 +1,167 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM pdfs
+
+#if !defined(__KPDFS_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __KPDFS_TRACE_H__
+
+/* kpdfs_trace.h defines the static tracepoints of pdfs. They are compiled
+   into kpdfs.c, which defines CREATE_TRACE_POINTS. */
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(pdfs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int found),
+    TP_ARGS(dir, dentry, found),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, dentry->d_name.name)
+        __field(int, found)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->found = found;
+    ),
+    TP_printk("dev %d,%d dir %lu name %s found %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->dir, __get_str(name), __entry->found)
+);
+
+TRACE_EVENT(pdfs_create_inode,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode, int ret),
+    TP_ARGS(dir, dentry, mode, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, dentry->d_name.name)
+        __field(umode_t, mode)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->mode = mode;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d dir %lu name %s mode 0%o ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->dir, __get_str(name), __entry->mode, __entry->ret)
+);
+
+DECLARE_EVENT_CLASS(pdfs_alloc_class,
+    TP_PROTO(struct super_block *sb, uint64_t no, int ret),
+    TP_ARGS(sb, no, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint64_t, no)
+        __field(int, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->no = no;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d no %llu ret %d",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->no, __entry->ret)
+);
+
+DEFINE_EVENT(pdfs_alloc_class, pdfs_alloc_pdfs_inode,
+    TP_PROTO(struct super_block *sb, uint64_t no, int ret),
+    TP_ARGS(sb, no, ret)
+);
+
+DEFINE_EVENT(pdfs_alloc_class, pdfs_free_pdfs_inode,
+    TP_PROTO(struct super_block *sb, uint64_t no, int ret),
+    TP_ARGS(sb, no, ret)
+);
+
+DEFINE_EVENT(pdfs_alloc_class, pdfs_alloc_data_block,
+    TP_PROTO(struct super_block *sb, uint64_t no, int ret),
+    TP_ARGS(sb, no, ret)
+);
+
+DEFINE_EVENT(pdfs_alloc_class, pdfs_free_data_block,
+    TP_PROTO(struct super_block *sb, uint64_t no, int ret),
+    TP_ARGS(sb, no, ret)
+);
+
+DECLARE_EVENT_CLASS(pdfs_rw_class,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+    TP_ARGS(inode, pos, len, ret),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(size_t, len)
+        __field(ssize_t, ret)
+    ),
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->len = len;
+        __entry->ret = ret;
+    ),
+    TP_printk("dev %d,%d ino %lu pos %lld len %zu ret %zd",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->ino, __entry->pos, __entry->len, __entry->ret)
+);
+
+DEFINE_EVENT(pdfs_rw_class, pdfs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+    TP_ARGS(inode, pos, len, ret)
+);
+
+DEFINE_EVENT(pdfs_rw_class, pdfs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, size_t len, ssize_t ret),
+    TP_ARGS(inode, pos, len, ret)
+);
+
+TRACE_EVENT(pdfs_readdir,
+    TP_PROTO(struct inode *dir, unsigned int nr_layers),
+    TP_ARGS(dir, nr_layers),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(unsigned int, nr_layers)
+    ),
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->nr_layers = nr_layers;
+    ),
+    TP_printk("dev %d,%d dir %lu layers %u",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->dir, __entry->nr_layers)
+);
+
+TRACE_EVENT(pdfs_save_sb,
+    TP_PROTO(struct super_block *sb),
+    TP_ARGS(sb),
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(uint64_t, inode_count)
+        __field(uint64_t, data_block_count)
+    ),
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->inode_count = PDFS_SB(sb)->inode_count;
+        __entry->data_block_count = PDFS_SB(sb)->data_block_count;
+    ),
+    TP_printk("dev %d,%d inodes %llu data blocks %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->inode_count, __entry->data_block_count)
+);
+
+#endif /*__KPDFS_TRACE_H__*/
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kpdfs_trace
+#include <trace/define_trace.h>
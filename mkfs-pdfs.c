@@ -3,18 +3,58 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "pdfs.h"
+#include "pdfs-crc32c.h"
+
+// Volume ids only need to be unique among the volumes mounted together
+static uint64_t new_volume_id(void) {
+    uint64_t id = 0;
+    int fd;
+
+    fd = open("/dev/urandom", O_RDONLY);
+    if (fd == -1 || sizeof(id) != read(fd, &id, sizeof(id))) {
+        id = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+    }
+    if (fd != -1) {
+        close(fd);
+    }
+    return id;
+}
+
+// Write a metadata block of the new volume, filling in its checksum tail
+static int write_meta_block(int fd, struct pdfs_superblock *pdfs_sb,
+                            uint64_t block_no, void *block) {
+    pdfs_set_block_csum(pdfs_sb, block_no, block);
+    if ((ssize_t)pdfs_sb->blocksize
+            != pwrite(fd, block, pdfs_sb->blocksize,
+                      block_no * pdfs_sb->blocksize)) {
+        return -1;
+    }
+    return 0;
+}
 
 int main(int argc, char *argv[]) {
     int fd;
+    int i;
     ssize_t ret;
+    char *end;
     uint64_t welcome_inode_no;
     uint64_t welcome_data_block_no_offset;
 
+    if (argc < 2 || argc - 2 > PDFS_MAX_LOWER_VOLUMES) {
+        fprintf(stderr,
+                "Usage: %s <device> [lower-volume-id ...]\n"
+                "At most %d lower volume ids, as printed by mkfs-pdfs.\n",
+                argv[0], PDFS_MAX_LOWER_VOLUMES);
+        return -1;
+    }
+
     fd = open(argv[1], O_RDWR);
     if (fd == -1) {
         perror("Error opening the device");
@@ -23,24 +63,36 @@ int main(int argc, char *argv[]) {
 
     // construct superblock
     struct pdfs_superblock pdfs_sb = {
-        .version = 1,
+        .version = PDFS_VERSION,
         .magic = PDFS_MAGIC,
         .blocksize = PDFS_DEFAULT_BLOCKSIZE,
         .inode_table_size = PDFS_DEFAULT_INODE_TABLE_SIZE,
         .inode_count = 2,
         .data_block_table_size = PDFS_DEFAULT_DATA_BLOCK_TABLE_SIZE,
         .data_block_count = 2,
+        .volume_id = new_volume_id(),
+        .lower_volume_count = argc - 2,
     };
+    for (i = 2; i < argc; i++) {
+        pdfs_sb.lower_volume_ids[i - 2] = strtoull(argv[i], &end, 16);
+        if (*end != '\0' || end == argv[i]) {
+            fprintf(stderr, "Invalid lower volume id: %s\n", argv[i]);
+            close(fd);
+            return -1;
+        }
+    }
 
     // construct inode bitmap
     char inode_bitmap[pdfs_sb.blocksize];
     memset(inode_bitmap, 0, sizeof(inode_bitmap));
-    inode_bitmap[0] = 1;
+    // root and welcome file inodes
+    inode_bitmap[0] = 0x3;
 
     // construct data block bitmap
     char data_block_bitmap[pdfs_sb.blocksize];
     memset(data_block_bitmap, 0, sizeof(data_block_bitmap));
-    data_block_bitmap[0] = 1;
+    // root and welcome file data blocks
+    data_block_bitmap[0] = 0x3;
 
     // construct root inode
     struct pdfs_inode root_pdfs_inode = {
@@ -73,85 +125,76 @@ int main(int argc, char *argv[]) {
         },
     };
 
+    // metadata blocks are written whole, ending with their checksum
+    char block[pdfs_sb.blocksize];
+    uint64_t block_no;
+
     ret = 0;
     do {
         // write super block
-        if (sizeof(pdfs_sb)
-                != write(fd, &pdfs_sb, sizeof(pdfs_sb))) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, &pdfs_sb, sizeof(pdfs_sb));
+        if (write_meta_block(fd, &pdfs_sb, PDFS_SUPERBLOCK_BLOCK_NO, block)) {
             ret = -1;
             break;
         }
-        if ((off_t)-1
-                == lseek(fd, pdfs_sb.blocksize, SEEK_SET)) {
-            ret = -2;
-            break;
-        }
 
         // write inode bitmap
-        if (sizeof(inode_bitmap)
-                != write(fd, inode_bitmap, sizeof(inode_bitmap))) {
+        if (write_meta_block(fd, &pdfs_sb, PDFS_INODE_BITMAP_BLOCK_NO,
+                             inode_bitmap)) {
             ret = -3;
             break;
         }
 
         // write data block bitmap
-        if (sizeof(data_block_bitmap)
-                != write(fd, data_block_bitmap,
-                         sizeof(data_block_bitmap))) {
+        if (write_meta_block(fd, &pdfs_sb, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO,
+                             data_block_bitmap)) {
             ret = -4;
             break;
         }
 
-        // write root inode
-        if (sizeof(root_pdfs_inode)
-                != write(fd, &root_pdfs_inode,
-                         sizeof(root_pdfs_inode))) {
-            ret = -5;
-            break;
+        // write inode table, root and welcome file inodes first; empty
+        // blocks need a valid checksum too
+        for (block_no = PDFS_INODE_TABLE_START_BLOCK_NO;
+             block_no < PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&pdfs_sb);
+             block_no++) {
+            memset(block, 0, sizeof(block));
+            if (block_no == PDFS_INODE_TABLE_START_BLOCK_NO) {
+                memcpy(block, &root_pdfs_inode, sizeof(root_pdfs_inode));
+                memcpy(block + sizeof(root_pdfs_inode), &welcome_pdfs_inode,
+                       sizeof(welcome_pdfs_inode));
+            }
+            if (write_meta_block(fd, &pdfs_sb, block_no, block)) {
+                ret = -5;
+                break;
+            }
         }
-
-        // write welcome file inode
-        if (sizeof(welcome_pdfs_inode)
-                != write(fd, &welcome_pdfs_inode,
-                         sizeof(welcome_pdfs_inode))) {
-            ret = -6;
+        if (ret) {
             break;
         }
 
         // write root inode data block
-        if ((off_t)-1
-                == lseek(
-                    fd,
-                    PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&pdfs_sb)
-                        * pdfs_sb.blocksize,
-                    SEEK_SET)) {
-            ret = -7;
-            break;
-        }
-        if (sizeof(root_dir_records)
-                != write(fd, root_dir_records,
-                         sizeof(root_dir_records))) {
+        memset(block, 0, sizeof(block));
+        memcpy(block, root_dir_records, sizeof(root_dir_records));
+        if (write_meta_block(fd, &pdfs_sb, root_pdfs_inode.data_block_no,
+                             block)) {
             ret = -8;
             break;
         }
 
         // write welcome file inode data block
-        if ((off_t)-1
-                == lseek(
-                    fd,
-                    (PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&pdfs_sb)
-                        + 1) * pdfs_sb.blocksize,
-                    SEEK_SET)) {
-            ret = -9;
-            break;
-        }
-        if (sizeof(welcome_body) != write(fd, welcome_body,
-                                          sizeof(welcome_body))) {
+        if (sizeof(welcome_body)
+                != pwrite(fd, welcome_body, sizeof(welcome_body),
+                          welcome_pdfs_inode.data_block_no
+                              * pdfs_sb.blocksize)) {
             ret = -10;
             break;
         }
     } while (0);
 
     close(fd);
+    if (ret == 0) {
+        printf("Volume id: %016" PRIx64 "\n", pdfs_sb.volume_id);
+    }
     return ret;
 }
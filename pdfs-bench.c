@@ -0,0 +1,540 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pdfs.h"
+
+/* pdfs-bench runs one metadata or data path workload against a mounted
+   pdfs directory and prints the result as a single JSON object.
+   pdfs-bench.sh drives it through the full benchmark matrix. */
+
+// A directory block holds this many records before its checksum tail
+#define DIR_CAPACITY ((PDFS_DEFAULT_BLOCKSIZE - sizeof(struct pdfs_block_tail)) \
+                      / sizeof(struct pdfs_dir_record))
+// Files of the data set are spread over directories of this many files
+#define FILES_PER_DIR (DIR_CAPACITY - 1)
+// Every file fits in its single data block
+#define FILE_SIZE PDFS_DEFAULT_BLOCKSIZE
+
+struct options {
+    const char *workload;
+    const char *dir;
+    const char *label;
+    int threads;
+    long count;
+    long rounds;
+    int depth;
+    size_t io_size;
+    int files;
+};
+
+struct worker {
+    pthread_t thread;
+    struct options *opts;
+    int id;
+    long ops;
+    uint64_t bytes;
+    uint64_t entries;
+    uint64_t *latencies;
+    int error;
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void data_file_path(struct options *opts, int i, char *path,
+                           size_t len) {
+    snprintf(path, len, "%s/data%d/f%d", opts->dir,
+             (int)(i / FILES_PER_DIR), i);
+}
+
+/* Evict unused dentries and inodes, so that the next lookups go through
+   pdfs instead of the dcache. Directory blocks stay in the buffer cache. */
+static int drop_dentries(void) {
+    int fd;
+    int ret = 0;
+
+    sync();
+    fd = open("/proc/sys/vm/drop_caches", O_WRONLY);
+    if (fd == -1) {
+        return errno;
+    }
+    if (write(fd, "2", 1) != 1) {
+        ret = errno;
+    }
+    close(fd);
+    return ret;
+}
+
+/* Worker bodies. Each one runs opts->count timed operations. */
+
+static void *stat_worker(void *arg, int hit) {
+    struct worker *w = arg;
+    struct options *opts = w->opts;
+    char path[PATH_MAX];
+    struct stat st;
+    uint64_t start;
+    long i;
+    int ret;
+
+    for (i = 0; i < opts->count; i++) {
+        if (hit) {
+            // The data set is far smaller than the dcache: start every pass
+            // over it cold, untimed
+            if (0 == i % opts->files) {
+                w->error = drop_dentries();
+                if (w->error) {
+                    break;
+                }
+            }
+            data_file_path(opts, (w->id + i) % opts->files, path,
+                           sizeof(path));
+        } else {
+            // Names unique across threads, so no negative dentry is reused
+            snprintf(path, sizeof(path), "%s/data%d/miss%d-%ld", opts->dir,
+                     (int)(i % ((opts->files + FILES_PER_DIR - 1)
+                                / FILES_PER_DIR)),
+                     w->id, i);
+        }
+        start = now_ns();
+        ret = stat(path, &st);
+        w->latencies[w->ops++] = now_ns() - start;
+        if (hit && ret) {
+            w->error = errno;
+            break;
+        }
+        if (!hit && (ret == 0 || errno != ENOENT)) {
+            w->error = ret == 0 ? EEXIST : errno;
+            break;
+        }
+    }
+    return NULL;
+}
+
+static void *stat_hit_worker(void *arg) {
+    return stat_worker(arg, 1);
+}
+
+static void *stat_miss_worker(void *arg) {
+    return stat_worker(arg, 0);
+}
+
+static void *readdir_worker(void *arg) {
+    struct worker *w = arg;
+    struct options *opts = w->opts;
+    char path[PATH_MAX];
+    struct dirent *entry;
+    uint64_t start;
+    DIR *dir;
+    long i;
+
+    snprintf(path, sizeof(path), "%s/data%d", opts->dir, w->id
+             % (int)((opts->files + FILES_PER_DIR - 1) / FILES_PER_DIR));
+    for (i = 0; i < opts->count; i++) {
+        start = now_ns();
+        dir = opendir(path);
+        if (!dir) {
+            w->error = errno;
+            break;
+        }
+        while ((entry = readdir(dir)) != NULL) {
+            w->entries++;
+        }
+        closedir(dir);
+        w->latencies[w->ops++] = now_ns() - start;
+    }
+    return NULL;
+}
+
+static void *io_worker(void *arg, int write, int random) {
+    struct worker *w = arg;
+    struct options *opts = w->opts;
+    char path[PATH_MAX];
+    unsigned int seed = w->id + 1;
+    size_t chunks = FILE_SIZE / opts->io_size;
+    uint64_t start;
+    char *buf;
+    off_t offset;
+    ssize_t ret;
+    long i;
+    int file;
+    int fd;
+
+    buf = malloc(opts->io_size);
+    if (!buf) {
+        w->error = ENOMEM;
+        return NULL;
+    }
+    memset(buf, 'a' + w->id % 26, opts->io_size);
+
+    for (i = 0; i < opts->count; i++) {
+        if (random) {
+            file = rand_r(&seed) % opts->files;
+            offset = (rand_r(&seed) % chunks) * opts->io_size;
+        } else {
+            // Each thread streams through its own files
+            file = (w->id + (i / chunks) * opts->threads) % opts->files;
+            offset = (i % chunks) * opts->io_size;
+        }
+        data_file_path(opts, file, path, sizeof(path));
+
+        start = now_ns();
+        fd = open(path, write ? O_WRONLY : O_RDONLY);
+        if (fd == -1) {
+            w->error = errno;
+            break;
+        }
+        if (write) {
+            ret = pwrite(fd, buf, opts->io_size, offset);
+        } else {
+            ret = pread(fd, buf, opts->io_size, offset);
+        }
+        close(fd);
+        w->latencies[w->ops++] = now_ns() - start;
+        if (ret != (ssize_t)opts->io_size) {
+            w->error = ret < 0 ? errno : EIO;
+            break;
+        }
+        w->bytes += ret;
+    }
+
+    free(buf);
+    return NULL;
+}
+
+static void *seq_read_worker(void *arg) {
+    return io_worker(arg, 0, 0);
+}
+
+static void *seq_write_worker(void *arg) {
+    return io_worker(arg, 1, 0);
+}
+
+static void *rand_read_worker(void *arg) {
+    return io_worker(arg, 0, 1);
+}
+
+static void *rand_write_worker(void *arg) {
+    return io_worker(arg, 1, 1);
+}
+
+/* Create opts->count files in one directory, rounds times. The files are
+   unlinked between rounds, outside of the timed section. */
+static void *create_flat_worker(void *arg) {
+    struct worker *w = arg;
+    struct options *opts = w->opts;
+    char path[PATH_MAX];
+    uint64_t start;
+    long round;
+    long i;
+    int fd;
+
+    for (round = 0; round < opts->rounds && !w->error; round++) {
+        for (i = 0; i < opts->count; i++) {
+            snprintf(path, sizeof(path), "%s/flat/t%d-%ld", opts->dir,
+                     w->id, i);
+            start = now_ns();
+            fd = open(path, O_CREAT | O_EXCL | O_WRONLY, 0644);
+            if (fd == -1) {
+                w->error = errno;
+                break;
+            }
+            close(fd);
+            w->latencies[w->ops++] = now_ns() - start;
+        }
+        for (i = 0; i < opts->count; i++) {
+            snprintf(path, sizeof(path), "%s/flat/t%d-%ld", opts->dir,
+                     w->id, i);
+            unlink(path);
+        }
+    }
+    return NULL;
+}
+
+/* A chain of opts->depth directories with opts->count files in each */
+static void *create_tree_worker(void *arg) {
+    struct worker *w = arg;
+    struct options *opts = w->opts;
+    char path[PATH_MAX];
+    char file[PATH_MAX + 32];
+    size_t len;
+    uint64_t start;
+    int level;
+    long i;
+    int fd;
+
+    len = snprintf(path, sizeof(path), "%s/tree%d", opts->dir, w->id);
+    for (level = 0; level < opts->depth; level++) {
+        start = now_ns();
+        if (mkdir(path, 0755)) {
+            w->error = errno;
+            break;
+        }
+        w->latencies[w->ops++] = now_ns() - start;
+
+        for (i = 0; i < opts->count; i++) {
+            snprintf(file, sizeof(file), "%s/f%ld", path, i);
+            start = now_ns();
+            fd = open(file, O_CREAT | O_EXCL | O_WRONLY, 0644);
+            if (fd == -1) {
+                w->error = errno;
+                return NULL;
+            }
+            close(fd);
+            w->latencies[w->ops++] = now_ns() - start;
+        }
+
+        len += snprintf(path + len, sizeof(path) - len, "/d%d", level);
+        if (len >= sizeof(path)) {
+            w->error = ENAMETOOLONG;
+            break;
+        }
+    }
+    return NULL;
+}
+
+/* Untimed: the data set used by the stat, readdir and I/O workloads */
+static int setup(struct options *opts) {
+    char path[PATH_MAX];
+    char buf[FILE_SIZE];
+    int dirs;
+    int fd;
+    int i;
+
+    memset(buf, 'x', sizeof(buf));
+    dirs = (opts->files + FILES_PER_DIR - 1) / FILES_PER_DIR;
+    for (i = 0; i < dirs; i++) {
+        snprintf(path, sizeof(path), "%s/data%d", opts->dir, i);
+        if (mkdir(path, 0755) && errno != EEXIST) {
+            perror(path);
+            return -1;
+        }
+    }
+    for (i = 0; i < opts->files; i++) {
+        data_file_path(opts, i, path, sizeof(path));
+        fd = open(path, O_CREAT | O_WRONLY, 0644);
+        if (fd == -1) {
+            perror(path);
+            return -1;
+        }
+        if (sizeof(buf) != write(fd, buf, sizeof(buf))) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        close(fd);
+    }
+
+    snprintf(path, sizeof(path), "%s/flat", opts->dir);
+    if (mkdir(path, 0755) && errno != EEXIST) {
+        perror(path);
+        return -1;
+    }
+    return 0;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static const struct {
+    const char *name;
+    void *(*fn)(void *);
+} workloads[] = {
+    { "create_flat", create_flat_worker },
+    { "create_tree", create_tree_worker },
+    { "stat_hit", stat_hit_worker },
+    { "stat_miss", stat_miss_worker },
+    { "readdir", readdir_worker },
+    { "seq_read", seq_read_worker },
+    { "seq_write", seq_write_worker },
+    { "rand_read", rand_read_worker },
+    { "rand_write", rand_write_worker },
+};
+
+static void usage(const char *prog) {
+    size_t i;
+
+    fprintf(stderr,
+            "Usage: %s <workload> <dir> [-t threads] [-n count] [-r rounds]\n"
+            "       [-d depth] [-s io_size] [-f files] [-l label]\n"
+            "Workloads: setup",
+            prog);
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        fprintf(stderr, " %s", workloads[i].name);
+    }
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[]) {
+    struct options opts = {
+        .label = "",
+        .threads = 1,
+        .count = 1000,
+        .rounds = 1,
+        .depth = 8,
+        .io_size = FILE_SIZE,
+        .files = 64,
+    };
+    void *(*fn)(void *) = NULL;
+    struct worker *workers;
+    uint64_t *latencies;
+    uint64_t start;
+    uint64_t elapsed;
+    uint64_t busy;
+    long ops = 0;
+    long max_ops;
+    double seconds;
+    double ops_per_sec = 0;
+    double bytes_per_sec = 0;
+    double entries_per_sec = 0;
+    size_t i;
+    long j;
+    int opt;
+    int t;
+    int started;
+    int error = 0;
+
+    if (argc < 3) {
+        usage(argv[0]);
+        return -1;
+    }
+    opts.workload = argv[1];
+    opts.dir = argv[2];
+    optind = 3;
+    while ((opt = getopt(argc, argv, "t:n:r:d:s:f:l:")) != -1) {
+        switch (opt) {
+        case 't': opts.threads = atoi(optarg); break;
+        case 'n': opts.count = atol(optarg); break;
+        case 'r': opts.rounds = atol(optarg); break;
+        case 'd': opts.depth = atoi(optarg); break;
+        case 's': opts.io_size = atol(optarg); break;
+        case 'f': opts.files = atoi(optarg); break;
+        case 'l': opts.label = optarg; break;
+        default:
+            usage(argv[0]);
+            return -1;
+        }
+    }
+    if (opts.threads < 1 || opts.count < 1 || opts.rounds < 1
+            || opts.files < 1 || opts.depth < 1 || opts.io_size < 1
+            || opts.io_size > FILE_SIZE || FILE_SIZE % opts.io_size) {
+        fprintf(stderr, "Invalid parameters\n");
+        return -1;
+    }
+
+    if (0 == strcmp(opts.workload, "setup")) {
+        return setup(&opts);
+    }
+    for (i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        if (0 == strcmp(opts.workload, workloads[i].name)) {
+            fn = workloads[i].fn;
+        }
+    }
+    if (!fn) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    // create_tree times a mkdir and count creates per level
+    max_ops = opts.count * opts.rounds + (opts.count + 1) * opts.depth;
+    workers = calloc(opts.threads, sizeof(*workers));
+    if (!workers) {
+        perror("calloc");
+        return -1;
+    }
+    for (t = 0; t < opts.threads; t++) {
+        workers[t].opts = &opts;
+        workers[t].id = t;
+        workers[t].latencies = malloc(max_ops * sizeof(uint64_t));
+        if (!workers[t].latencies) {
+            perror("malloc");
+            return -1;
+        }
+    }
+
+    start = now_ns();
+    for (started = 0; started < opts.threads; started++) {
+        error = pthread_create(&workers[started].thread, NULL, fn,
+                               &workers[started]);
+        if (error) {
+            fprintf(stderr, "pthread_create: %s\n", strerror(error));
+            break;
+        }
+    }
+    for (t = 0; t < started; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    elapsed = now_ns() - start;
+
+    // Rates count timed sections only, so untimed setup such as unlinks
+    // between rounds or dropped caches doesn't dilute them. Threads run
+    // concurrently, so their rates add up.
+    for (t = 0; t < started; t++) {
+        ops += workers[t].ops;
+        busy = 0;
+        for (j = 0; j < workers[t].ops; j++) {
+            busy += workers[t].latencies[j];
+        }
+        if (busy) {
+            ops_per_sec += workers[t].ops * 1e9 / busy;
+            bytes_per_sec += workers[t].bytes * 1e9 / busy;
+            entries_per_sec += workers[t].entries * 1e9 / busy;
+        }
+        if (workers[t].error) {
+            error = workers[t].error;
+        }
+    }
+    latencies = malloc((ops ? ops : 1) * sizeof(uint64_t));
+    if (!latencies) {
+        perror("malloc");
+        return -1;
+    }
+    ops = 0;
+    for (t = 0; t < opts.threads; t++) {
+        if (t < started) {
+            memcpy(latencies + ops, workers[t].latencies,
+                   workers[t].ops * sizeof(uint64_t));
+            ops += workers[t].ops;
+        }
+        free(workers[t].latencies);
+    }
+    qsort(latencies, ops, sizeof(uint64_t), compare_u64);
+
+    seconds = elapsed / 1e9;
+    printf("{\"label\":\"%s\",\"workload\":\"%s\",\"threads\":%d,"
+           "\"count\":%ld,\"rounds\":%ld,\"depth\":%d,\"io_size\":%zu,"
+           "\"ops\":%ld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"bytes_per_sec\":%.1f,\"entries_per_sec\":%.1f,"
+           "\"lat_p50_ns\":%llu,\"lat_p99_ns\":%llu,"
+           "\"lat_max_ns\":%llu,\"error\":\"%s\"}\n",
+           opts.label, opts.workload, opts.threads, opts.count, opts.rounds,
+           opts.depth, opts.io_size, ops, seconds, ops_per_sec,
+           bytes_per_sec, entries_per_sec,
+           ops ? (unsigned long long)latencies[ops / 2] : 0ull,
+           ops ? (unsigned long long)latencies[ops * 99 / 100] : 0ull,
+           ops ? (unsigned long long)latencies[ops - 1] : 0ull,
+           error ? strerror(error) : "");
+
+    free(latencies);
+    free(workers);
+    return error ? 1 : 0;
+}
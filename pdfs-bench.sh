@@ -0,0 +1,75 @@
+#!/bin/bash
+
+# Runs the pdfs benchmark matrix and prints one JSON object per run, to
+# stdout or to the file given as first argument. Every run gets a freshly
+# formatted loop image and starts with cold caches, so results can be
+# compared across commits. Build first with `make ko mkfs-pdfs pdfs-bench`,
+# or run everything with `sudo make bench`.
+
+set -e
+
+root_pwd="$PWD"
+bench_dir="bench-dir-$RANDOM"
+bench_mount_point="bench-mount-point-$RANDOM"
+output="${1:-/dev/stdout}"
+label="$(git rev-parse --short HEAD 2>/dev/null || echo unknown)"
+# Files of the data set read and written by the stat, readdir and I/O runs
+data_files=64
+
+function prepare_fs() {
+    dd bs=4096 count=6000 if=/dev/zero of="$bench_dir/image" 2>/dev/null
+    ./mkfs-pdfs "$bench_dir/image" > /dev/null
+    mount -o loop -t pdfs "$bench_dir/image" "$bench_mount_point"
+    ./pdfs-bench setup "$bench_mount_point" -f "$data_files"
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+}
+
+function release_fs() {
+    umount "$bench_mount_point"
+}
+
+# run <workload> [pdfs-bench options]
+function run() {
+    prepare_fs
+    ./pdfs-bench "$1" "$bench_mount_point" -f "$data_files" -l "$label" \
+        "${@:2}" >> "$output"
+    release_fs
+}
+
+function cleanup() {
+    cd "$root_pwd"
+    mount | grep -q "$bench_mount_point" && umount -t pdfs "$bench_mount_point"
+    lsmod | grep -q pdfs && rmmod "$root_pwd/pdfs.ko"
+    rm -fR "$bench_dir" "$bench_mount_point"
+}
+
+cleanup
+trap cleanup SIGINT EXIT
+mkdir "$bench_dir" "$bench_mount_point"
+modprobe libcrc32c
+insmod ./pdfs.ko
+
+# metadata: a directory block holds 15 records, so mass creates in one
+# directory are repeated in rounds, unlinking between rounds
+run create_flat -t 1 -n 14 -r 50
+run create_flat -t 2 -n 7 -r 50
+run create_tree -t 1 -d 32 -n 4
+run create_tree -t 4 -d 16 -n 4
+
+for threads in 1 4; do
+    run stat_hit -t "$threads" -n 20000
+    run stat_miss -t "$threads" -n 20000
+    run readdir -t "$threads" -n 5000
+done
+
+# data: small and whole-block I/O, files are a single block
+for workload in seq_read seq_write rand_read rand_write; do
+    for io_size in 512 4096; do
+        for threads in 1 2 4 8; do
+            run "$workload" -t "$threads" -s "$io_size" -n 5000
+        done
+    done
+done
+
+rmmod ./pdfs.ko
@@ -0,0 +1,65 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pdfs.h"
+
+/* pdfs-cp copies a file on a mounted pdfs volume with PDFS_IOC_COPY_RANGE,
+   so the data never leaves the kernel. It doesn't fall back to read and
+   write: a copy the ioctl can't do is an error. */
+
+int main(int argc, char *argv[]) {
+    struct pdfs_copy_range_args args;
+    struct stat st;
+    long copied;
+    int src_fd;
+    int dest_fd;
+    int ret = -1;
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <source> <dest>\n", argv[0]);
+        return -1;
+    }
+
+    src_fd = open(argv[1], O_RDONLY);
+    if (src_fd == -1 || fstat(src_fd, &st)) {
+        perror("Error opening the source");
+        return -1;
+    }
+    dest_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, st.st_mode & 0777);
+    if (dest_fd == -1) {
+        perror("Error opening the destination");
+        close(src_fd);
+        return -1;
+    }
+
+    memset(&args, 0, sizeof(args));
+    args.src_fd = src_fd;
+    while (args.src_offset < (uint64_t)st.st_size) {
+        args.src_length = st.st_size - args.src_offset;
+        copied = ioctl(dest_fd, PDFS_IOC_COPY_RANGE, &args);
+        if (copied < 0) {
+            perror("PDFS_IOC_COPY_RANGE");
+            goto out;
+        }
+        if (copied == 0) {
+            // The source shrank underneath us
+            break;
+        }
+        args.src_offset += copied;
+        args.dest_offset += copied;
+    }
+    ret = 0;
+
+out:
+    close(dest_fd);
+    close(src_fd);
+    return ret;
+}
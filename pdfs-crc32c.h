@@ -0,0 +1,108 @@
+#ifndef __PDFS_CRC32C_H__
+#define __PDFS_CRC32C_H__
+
+/* Metadata block checksums for the userspace tools. pdfs_crc32c matches
+   the kernel's crc32c(): the caller passes the seed and the result is not
+   inverted. It uses the SSE4.2 crc32 instruction when the CPU has it. */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "pdfs.h"
+
+// Castagnoli polynomial, bit-reflected
+#define PDFS_CRC32C_POLY 0x82f63b78
+
+static uint32_t pdfs_crc32c_table[256];
+
+__attribute__((constructor))
+static void pdfs_crc32c_init_table(void) {
+    uint32_t crc;
+    int i;
+    int j;
+
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc >> 1) ^ ((crc & 1) ? PDFS_CRC32C_POLY : 0);
+        }
+        pdfs_crc32c_table[i] = crc;
+    }
+}
+
+static inline uint32_t pdfs_crc32c_sw(uint32_t crc, const void *buf,
+                                      size_t len) {
+    const unsigned char *p = buf;
+
+    while (len--) {
+        crc = pdfs_crc32c_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static inline uint32_t pdfs_crc32c_sse42(uint32_t crc, const void *buf,
+                                         size_t len) {
+    const unsigned char *p = buf;
+    uint64_t crc64 = crc;
+    uint64_t word;
+
+    while (len >= sizeof(word)) {
+        memcpy(&word, p, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+        p += sizeof(word);
+        len -= sizeof(word);
+    }
+    crc = (uint32_t)crc64;
+    while (len--) {
+        crc = _mm_crc32_u8(crc, *p++);
+    }
+    return crc;
+}
+#endif
+
+static inline uint32_t pdfs_crc32c(uint32_t crc, const void *buf,
+                                   size_t len) {
+#if defined(__x86_64__)
+    if (__builtin_cpu_supports("sse4.2")) {
+        return pdfs_crc32c_sse42(crc, buf, len);
+    }
+#endif
+    return pdfs_crc32c_sw(crc, buf, len);
+}
+
+/* The checksum stored in the pdfs_block_tail of metadata block block_no */
+static inline uint32_t pdfs_block_csum(struct pdfs_superblock *pdfs_sb,
+                                       uint64_t block_no, const void *block) {
+    uint32_t crc;
+
+    crc = pdfs_crc32c(~0U, &block_no, sizeof(block_no));
+    return pdfs_crc32c(crc, block, PDFS_BLOCK_TAIL_OFFSET_HSB(pdfs_sb));
+}
+
+static inline struct pdfs_block_tail *pdfs_block_tail(
+        struct pdfs_superblock *pdfs_sb, void *block) {
+    return (struct pdfs_block_tail *)((char *)block
+                                      + PDFS_BLOCK_TAIL_OFFSET_HSB(pdfs_sb));
+}
+
+static inline void pdfs_set_block_csum(struct pdfs_superblock *pdfs_sb,
+                                       uint64_t block_no, void *block) {
+    pdfs_block_tail(pdfs_sb, block)->checksum
+        = pdfs_block_csum(pdfs_sb, block_no, block);
+}
+
+static inline int pdfs_block_csum_ok(struct pdfs_superblock *pdfs_sb,
+                                     uint64_t block_no, void *block) {
+    return pdfs_block_tail(pdfs_sb, block)->checksum
+           == pdfs_block_csum(pdfs_sb, block_no, block);
+}
+
+#endif /*__PDFS_CRC32C_H__*/
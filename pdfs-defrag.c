@@ -0,0 +1,512 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <libgen.h>
+#include <linux/fs.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "pdfs.h"
+#include "pdfs-crc32c.h"
+
+/* pdfs-defrag rewrites an unmounted pdfs image compactly. Inodes are
+   renumbered in breadth-first order from the root, so the children of a
+   directory are adjacent in the inode table, and every inode gets the data
+   block at the same offset in the data block table. The tree then occupies
+   the start of both tables in the order a walk visits it, and the bitmaps
+   are regenerated to match. Inodes that can't be reached from the root
+   are dropped. */
+
+// Data blocks are read and written this many at a time
+#define PDFS_DEFRAG_CHUNK_BLOCKS 256
+
+#define PDFS_DEFRAG_NO_INODE UINT64_MAX
+
+struct pdfs_defrag {
+    struct pdfs_superblock sb;
+    uint64_t data_start;
+    // Blocks 0 to data_start - 1 of the source image
+    char *meta;
+    // Source inode numbers in their new order
+    uint64_t *order;
+    uint64_t count;
+    // New inode number of every source inode
+    uint64_t *new_no;
+};
+
+static int read_full(int fd, void *buf, size_t len, off_t pos) {
+    ssize_t ret;
+
+    while (len) {
+        ret = pread(fd, buf, len, pos);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        buf = (char *)buf + ret;
+        len -= ret;
+        pos += ret;
+    }
+    return 0;
+}
+
+static int write_full(int fd, const void *buf, size_t len, off_t pos) {
+    ssize_t ret;
+
+    while (len) {
+        ret = pwrite(fd, buf, len, pos);
+        if (ret < 0 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        buf = (const char *)buf + ret;
+        len -= ret;
+        pos += ret;
+    }
+    return 0;
+}
+
+static char *meta_block(struct pdfs_defrag *d, uint64_t block_no) {
+    return d->meta + block_no * d->sb.blocksize;
+}
+
+static struct pdfs_inode *source_inode(struct pdfs_defrag *d,
+                                       uint64_t inode_no) {
+    return (struct pdfs_inode *)meta_block(
+               d, PDFS_INODE_TABLE_START_BLOCK_NO
+                  + inode_no / PDFS_INODES_PER_BLOCK_HSB(&d->sb))
+           + inode_no % PDFS_INODES_PER_BLOCK_HSB(&d->sb);
+}
+
+/* Read the superblock, bitmaps and inode table in one go and check them */
+static int load_meta(struct pdfs_defrag *d, int fd) {
+    char block[PDFS_DEFAULT_BLOCKSIZE];
+    uint64_t block_no;
+
+    if (read_full(fd, block, sizeof(block), 0)) {
+        perror("Error reading the superblock");
+        return -1;
+    }
+    memcpy(&d->sb, block, sizeof(d->sb));
+    if (d->sb.magic != PDFS_MAGIC || d->sb.version != PDFS_VERSION
+            || d->sb.blocksize != PDFS_DEFAULT_BLOCKSIZE) {
+        fprintf(stderr, "Not a version %d pdfs image\n", PDFS_VERSION);
+        return -1;
+    }
+    if (d->sb.inode_table_size > PDFS_BITMAP_MAX_BITS_HSB(&d->sb)
+            || d->sb.data_block_table_size
+                   > PDFS_BITMAP_MAX_BITS_HSB(&d->sb)) {
+        fprintf(stderr, "Inode or data block table too large\n");
+        return -1;
+    }
+
+    d->data_start = PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&d->sb);
+    d->meta = malloc(d->data_start * d->sb.blocksize);
+    if (!d->meta) {
+        perror("Error allocating the metadata buffer");
+        return -1;
+    }
+    if (read_full(fd, d->meta, d->data_start * d->sb.blocksize, 0)) {
+        perror("Error reading the metadata");
+        return -1;
+    }
+    for (block_no = 0; block_no < d->data_start; block_no++) {
+        if (!pdfs_block_csum_ok(&d->sb, block_no, meta_block(d, block_no))) {
+            fprintf(stderr, "Checksum mismatch in block %" PRIu64 "\n",
+                    block_no);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int valid_data_block(struct pdfs_defrag *d, struct pdfs_inode *inode) {
+    return inode->data_block_no >= d->data_start
+           && inode->data_block_no
+                  < d->data_start + d->sb.data_block_table_size;
+}
+
+/* Number the inodes reachable from the root in breadth-first order.
+   Directory blocks are read into dir_blocks, indexed by new number, since
+   their records are rewritten anyway. */
+static int plan_layout(struct pdfs_defrag *d, int fd, char **dir_blocks) {
+    struct pdfs_dir_record *records;
+    struct pdfs_inode *inode;
+    uint64_t child_no;
+    uint64_t head;
+    uint64_t i;
+
+    d->order = malloc(d->sb.inode_table_size * sizeof(*d->order));
+    d->new_no = malloc(d->sb.inode_table_size * sizeof(*d->new_no));
+    if (!d->order || !d->new_no) {
+        perror("Error allocating the inode map");
+        return -1;
+    }
+    for (i = 0; i < d->sb.inode_table_size; i++) {
+        d->new_no[i] = PDFS_DEFRAG_NO_INODE;
+    }
+
+    d->order[0] = PDFS_ROOTDIR_INODE_NO;
+    d->new_no[PDFS_ROOTDIR_INODE_NO] = 0;
+    d->count = 1;
+    for (head = 0; head < d->count; head++) {
+        if (head >= d->sb.data_block_table_size) {
+            fprintf(stderr, "More inodes than data blocks\n");
+            return -1;
+        }
+        inode = source_inode(d, d->order[head]);
+        if (inode->inode_no != d->order[head] || !valid_data_block(d, inode)) {
+            fprintf(stderr, "Corrupt inode %" PRIu64 "\n", d->order[head]);
+            return -1;
+        }
+        if (!S_ISDIR(inode->mode)) {
+            continue;
+        }
+        if (inode->dir_children_count > PDFS_DIR_MAX_RECORD_HSB(&d->sb)) {
+            fprintf(stderr, "Corrupt directory inode %" PRIu64 "\n",
+                    inode->inode_no);
+            return -1;
+        }
+
+        dir_blocks[head] = malloc(d->sb.blocksize);
+        if (!dir_blocks[head]) {
+            perror("Error allocating a directory block");
+            return -1;
+        }
+        if (read_full(fd, dir_blocks[head], d->sb.blocksize,
+                      inode->data_block_no * d->sb.blocksize)) {
+            perror("Error reading a directory block");
+            return -1;
+        }
+        if (!pdfs_block_csum_ok(&d->sb, inode->data_block_no,
+                                dir_blocks[head])) {
+            fprintf(stderr, "Checksum mismatch in block %" PRIu64 "\n",
+                    inode->data_block_no);
+            return -1;
+        }
+
+        records = (struct pdfs_dir_record *)dir_blocks[head];
+        for (i = 0; i < inode->dir_children_count; i++) {
+            child_no = records[i].inode_no;
+            if (child_no >= d->sb.inode_table_size) {
+                fprintf(stderr, "Corrupt record in directory inode %"
+                        PRIu64 "\n", inode->inode_no);
+                return -1;
+            }
+            // Hard links keep the number of their first visit
+            if (d->new_no[child_no] == PDFS_DEFRAG_NO_INODE) {
+                d->new_no[child_no] = d->count;
+                d->order[d->count++] = child_no;
+            }
+            records[i].inode_no = d->new_no[child_no];
+        }
+    }
+    return 0;
+}
+
+/* Read the data blocks of all non-directory inodes into data, in their new
+   order. The source table is read in large sequential chunks rather than
+   a block at a time, skipping chunks no inode uses. */
+static int gather_data(struct pdfs_defrag *d, int fd, char *data,
+                       char **dir_blocks) {
+    uint64_t *slot_of = NULL;
+    struct pdfs_inode *inode;
+    uint64_t chunk_start;
+    uint64_t chunk_len;
+    uint64_t last = 0;
+    uint64_t block;
+    uint64_t i;
+    char *chunk = NULL;
+    int ret = -1;
+
+    // Source data block offset to new slot
+    slot_of = malloc(d->sb.data_block_table_size * sizeof(*slot_of));
+    chunk = malloc(PDFS_DEFRAG_CHUNK_BLOCKS * d->sb.blocksize);
+    if (!slot_of || !chunk) {
+        perror("Error allocating the data buffers");
+        goto out;
+    }
+    for (i = 0; i < d->sb.data_block_table_size; i++) {
+        slot_of[i] = PDFS_DEFRAG_NO_INODE;
+    }
+    for (i = 0; i < d->count; i++) {
+        inode = source_inode(d, d->order[i]);
+        if (dir_blocks[i] || (inode->flags & PDFS_INODE_FL_UNWRITTEN)) {
+            continue;
+        }
+        block = inode->data_block_no - d->data_start;
+        slot_of[block] = i;
+        if (block + 1 > last) {
+            last = block + 1;
+        }
+    }
+
+    for (chunk_start = 0; chunk_start < last;
+         chunk_start += PDFS_DEFRAG_CHUNK_BLOCKS) {
+        chunk_len = last - chunk_start;
+        if (chunk_len > PDFS_DEFRAG_CHUNK_BLOCKS) {
+            chunk_len = PDFS_DEFRAG_CHUNK_BLOCKS;
+        }
+        for (i = 0; i < chunk_len; i++) {
+            if (slot_of[chunk_start + i] != PDFS_DEFRAG_NO_INODE) {
+                break;
+            }
+        }
+        if (i == chunk_len) {
+            continue;
+        }
+
+        if (read_full(fd, chunk, chunk_len * d->sb.blocksize,
+                      (d->data_start + chunk_start) * d->sb.blocksize)) {
+            perror("Error reading data blocks");
+            goto out;
+        }
+        for (i = 0; i < chunk_len; i++) {
+            if (slot_of[chunk_start + i] != PDFS_DEFRAG_NO_INODE) {
+                memcpy(data + slot_of[chunk_start + i] * d->sb.blocksize,
+                       chunk + i * d->sb.blocksize, d->sb.blocksize);
+            }
+        }
+    }
+    ret = 0;
+
+out:
+    free(chunk);
+    free(slot_of);
+    return ret;
+}
+
+/* Build the new metadata blocks in place of the old ones */
+static void rebuild_meta(struct pdfs_defrag *d, char *new_meta) {
+    struct pdfs_inode *inode;
+    uint64_t block_no;
+    uint64_t i;
+    char *block;
+
+    memset(new_meta, 0, d->data_start * d->sb.blocksize);
+
+    d->sb.inode_count = d->count;
+    d->sb.data_block_count = d->count;
+    memcpy(new_meta, &d->sb, sizeof(d->sb));
+
+    // Inode i owns data block i, so both bitmaps start with count bits set
+    for (i = 0; i < d->count; i++) {
+        new_meta[PDFS_INODE_BITMAP_BLOCK_NO * d->sb.blocksize
+                 + i / BITS_IN_BYTE] |= 1 << (i % BITS_IN_BYTE);
+        new_meta[PDFS_DATA_BLOCK_BITMAP_BLOCK_NO * d->sb.blocksize
+                 + i / BITS_IN_BYTE] |= 1 << (i % BITS_IN_BYTE);
+    }
+
+    for (i = 0; i < d->count; i++) {
+        block = new_meta + (PDFS_INODE_TABLE_START_BLOCK_NO
+                            + i / PDFS_INODES_PER_BLOCK_HSB(&d->sb))
+                           * d->sb.blocksize;
+        inode = (struct pdfs_inode *)block
+                + i % PDFS_INODES_PER_BLOCK_HSB(&d->sb);
+        // Flags, including UNWRITTEN and COMPRESSED, carry over as is
+        memcpy(inode, source_inode(d, d->order[i]), sizeof(*inode));
+        inode->inode_no = i;
+        inode->data_block_no = d->data_start + i;
+    }
+
+    for (block_no = 0; block_no < d->data_start; block_no++) {
+        pdfs_set_block_csum(&d->sb, block_no,
+                            new_meta + block_no * d->sb.blocksize);
+    }
+}
+
+/* Size a new image to the source's tables, the unused tail of which is a
+   hole. A block device can't be resized and only has to be large enough. */
+static int size_output(int fd, uint64_t size) {
+    uint64_t dev_size;
+    struct stat st;
+
+    if (fstat(fd, &st)) {
+        return -1;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        if (ioctl(fd, BLKGETSIZE64, &dev_size)) {
+            return -1;
+        }
+        if (dev_size < size) {
+            errno = ENOSPC;
+            return -1;
+        }
+        return 0;
+    }
+    return ftruncate(fd, size);
+}
+
+/* fsync the directory holding path, so a rename into it is durable */
+static int sync_parent(const char *path) {
+    char *dir = strdup(path);
+    int fd = -1;
+    int ret = -1;
+
+    if (dir) {
+        fd = open(dirname(dir), O_RDONLY | O_DIRECTORY);
+    }
+    if (fd != -1) {
+        ret = fsync(fd);
+        close(fd);
+    }
+    free(dir);
+    return ret;
+}
+
+int main(int argc, char *argv[]) {
+    struct pdfs_defrag d;
+    char **dir_blocks = NULL;
+    char *new_meta = NULL;
+    char *data = NULL;
+    const char *prog = argv[0];
+    char *tmp_path = NULL;
+    struct stat st;
+    int unsafe_in_place = 0;
+    int in_fd = -1;
+    int out_fd = -1;
+    uint64_t before;
+    uint64_t size;
+    uint64_t i;
+    int ret = -1;
+
+    if (argc > 1 && 0 == strcmp(argv[1], "--unsafe-in-place")) {
+        unsafe_in_place = 1;
+        argc--;
+        argv++;
+    }
+    if (argc < 2 || argc > 3 || (unsafe_in_place && argc == 3)) {
+        fprintf(stderr,
+                "Usage: %s [--unsafe-in-place] <image> [<output-image>]\n"
+                "Compacts an unmounted pdfs image into the output image, or\n"
+                "into a copy that then replaces the image. With\n"
+                "--unsafe-in-place the image is overwritten directly, which\n"
+                "a crash leaves inconsistent; block devices need it.\n",
+                prog);
+        return -1;
+    }
+    memset(&d, 0, sizeof(d));
+
+    in_fd = open(argv[1], unsafe_in_place ? O_RDWR : O_RDONLY);
+    if (in_fd == -1 || fstat(in_fd, &st)) {
+        perror("Error opening the image");
+        goto out;
+    }
+    if (argc == 2 && !unsafe_in_place && !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "%s can't be replaced by a copy; give an output "
+                        "image or --unsafe-in-place\n", argv[1]);
+        goto out;
+    }
+    if (load_meta(&d, in_fd)) {
+        goto out;
+    }
+    before = d.sb.inode_count;
+
+    dir_blocks = calloc(d.sb.inode_table_size, sizeof(*dir_blocks));
+    if (!dir_blocks || plan_layout(&d, in_fd, dir_blocks)) {
+        goto out;
+    }
+
+    data = calloc(d.count, d.sb.blocksize);
+    new_meta = malloc(d.data_start * d.sb.blocksize);
+    if (!data || !new_meta) {
+        perror("Error allocating the new image");
+        goto out;
+    }
+    if (gather_data(&d, in_fd, data, dir_blocks)) {
+        goto out;
+    }
+    for (i = 0; i < d.count; i++) {
+        if (dir_blocks[i]) {
+            memcpy(data + i * d.sb.blocksize, dir_blocks[i], d.sb.blocksize);
+            pdfs_set_block_csum(&d.sb, d.data_start + i,
+                                data + i * d.sb.blocksize);
+        }
+    }
+    rebuild_meta(&d, new_meta);
+
+    // The source's size says nothing when it is a block device
+    size = (d.data_start + d.sb.data_block_table_size) * d.sb.blocksize;
+    if (argc == 3) {
+        out_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    } else if (!unsafe_in_place) {
+        // Next to the image, so it can be renamed over it
+        tmp_path = malloc(strlen(argv[1]) + sizeof(".defrag-XXXXXX"));
+        if (tmp_path) {
+            sprintf(tmp_path, "%s.defrag-XXXXXX", argv[1]);
+            out_fd = mkstemp(tmp_path);
+        }
+    } else {
+        out_fd = in_fd;
+    }
+    if (out_fd == -1 || (out_fd != in_fd && size_output(out_fd, size))) {
+        perror("Error creating the output image");
+        goto out;
+    }
+
+    // Everything was read above, so with --unsafe-in-place the old blocks
+    // can be overwritten. Data goes first and the metadata that points at
+    // it last, but a crash in between still leaves the image inconsistent.
+    if (write_full(out_fd, data, d.count * d.sb.blocksize,
+                   d.data_start * d.sb.blocksize)
+            || fsync(out_fd)
+            || write_full(out_fd, new_meta, d.data_start * d.sb.blocksize, 0)
+            || fsync(out_fd)) {
+        perror("Error writing the image");
+        goto out;
+    }
+    if (tmp_path) {
+        // The copy replaces the image only once it is complete and on disk
+        if (fchmod(out_fd, st.st_mode & 07777)
+                || rename(tmp_path, argv[1])) {
+            perror("Error replacing the image");
+            goto out;
+        }
+        free(tmp_path);
+        tmp_path = NULL;
+        if (sync_parent(argv[1])) {
+            perror("Error syncing the image's directory");
+            goto out;
+        }
+    }
+
+    printf("%" PRIu64 " inodes, %" PRIu64 " unreachable ones dropped\n",
+           d.count, before > d.count ? before - d.count : 0);
+    ret = 0;
+
+out:
+    if (tmp_path) {
+        if (out_fd != -1) {
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+    }
+    if (out_fd != -1 && out_fd != in_fd) {
+        close(out_fd);
+    }
+    if (in_fd != -1) {
+        close(in_fd);
+    }
+    if (dir_blocks) {
+        for (i = 0; i < d.sb.inode_table_size; i++) {
+            free(dir_blocks[i]);
+        }
+        free(dir_blocks);
+    }
+    free(data);
+    free(new_meta);
+    free(d.order);
+    free(d.new_no);
+    free(d.meta);
+    return ret;
+}
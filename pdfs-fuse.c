@@ -0,0 +1,1469 @@
+#define FUSE_USE_VERSION 34
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <fuse_lowlevel.h>
+#include <inttypes.h>
+#include <linux/fs.h>
+#include <lz4.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pdfs.h"
+#include "pdfs-crc32c.h"
+
+/* pdfs-fuse serves a pdfs image from userspace with the FUSE low-level API.
+   It reads and writes the same on-disk format as the kernel module. */
+
+// The pdfs root inode is 0, FUSE reserves 0 and uses 1 for the root
+#define PDFS_FUSE_INO(inode_no) ((fuse_ino_t)(inode_no) + 1)
+#define PDFS_INODE_NO(ino) ((uint64_t)(ino) - 1)
+
+// Kernel-side lookup state of an inode. An unlinked inode is freed once the
+// kernel forgets its last lookup, so open files stay readable.
+struct pdfs_node {
+    uint64_t nlookup;
+    int unlinked;
+};
+
+// Data writes that change neither the size nor the flags of an inode run
+// under the shared lock, serialized per inode by one of these
+#define PDFS_FUSE_DATA_LOCKS 64
+
+struct pdfs_fuse {
+    int fd;
+    struct pdfs_superblock sb;
+    // Readers share the image, anything that modifies metadata is exclusive
+    pthread_rwlock_t lock;
+    pthread_mutex_t data_locks[PDFS_FUSE_DATA_LOCKS];
+    struct pdfs_node *nodes;
+    time_t mount_time;
+
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    // New regular files get PDFS_INODE_FL_COMPRESS
+    int compress;
+};
+
+static struct pdfs_fuse *PDFS_FUSE(fuse_req_t req) {
+    return fuse_req_userdata(req);
+}
+
+/* Block and inode I/O */
+
+static int read_at(struct pdfs_fuse *fs, void *buf, size_t len, off_t pos) {
+    ssize_t ret = pread(fs->fd, buf, len, pos);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret == (ssize_t)len ? 0 : -EIO;
+}
+
+static int write_at(struct pdfs_fuse *fs, const void *buf, size_t len,
+                    off_t pos) {
+    ssize_t ret = pwrite(fs->fd, buf, len, pos);
+
+    if (ret < 0) {
+        return -errno;
+    }
+    return ret == (ssize_t)len ? 0 : -EIO;
+}
+
+/* Read a metadata block and check its checksum tail */
+static int read_meta(struct pdfs_fuse *fs, uint64_t block_no, void *buf) {
+    int ret;
+
+    ret = read_at(fs, buf, fs->sb.blocksize, block_no * fs->sb.blocksize);
+    if (ret) {
+        return ret;
+    }
+    if (!pdfs_block_csum_ok(&fs->sb, block_no, buf)) {
+        fprintf(stderr, "pdfs: checksum mismatch in block %" PRIu64 "\n",
+                block_no);
+        return -EIO;
+    }
+    return 0;
+}
+
+static int write_meta(struct pdfs_fuse *fs, uint64_t block_no, void *buf) {
+    pdfs_set_block_csum(&fs->sb, block_no, buf);
+    return write_at(fs, buf, fs->sb.blocksize, block_no * fs->sb.blocksize);
+}
+
+static int save_sb(struct pdfs_fuse *fs) {
+    char block[fs->sb.blocksize];
+    int ret;
+
+    ret = read_meta(fs, PDFS_SUPERBLOCK_BLOCK_NO, block);
+    if (ret) {
+        return ret;
+    }
+    memcpy(block, &fs->sb, sizeof(fs->sb));
+    return write_meta(fs, PDFS_SUPERBLOCK_BLOCK_NO, block);
+}
+
+static uint64_t inode_block_no(struct pdfs_fuse *fs, uint64_t inode_no) {
+    return PDFS_INODE_TABLE_START_BLOCK_NO
+           + inode_no / PDFS_INODES_PER_BLOCK_HSB(&fs->sb);
+}
+
+static struct pdfs_inode *inode_in_block(struct pdfs_fuse *fs, char *block,
+                                         uint64_t inode_no) {
+    return (struct pdfs_inode *)block
+           + inode_no % PDFS_INODES_PER_BLOCK_HSB(&fs->sb);
+}
+
+static int load_inode(struct pdfs_fuse *fs, uint64_t inode_no,
+                      struct pdfs_inode *inode) {
+    char block[fs->sb.blocksize];
+    int ret;
+
+    if (inode_no >= fs->sb.inode_table_size) {
+        return -ENOENT;
+    }
+    ret = read_meta(fs, inode_block_no(fs, inode_no), block);
+    if (ret) {
+        return ret;
+    }
+    memcpy(inode, inode_in_block(fs, block, inode_no), sizeof(*inode));
+    return 0;
+}
+
+static int save_inode(struct pdfs_fuse *fs, struct pdfs_inode *inode) {
+    char block[fs->sb.blocksize];
+    uint64_t block_no = inode_block_no(fs, inode->inode_no);
+    int ret;
+
+    ret = read_meta(fs, block_no, block);
+    if (ret) {
+        return ret;
+    }
+    memcpy(inode_in_block(fs, block, inode->inode_no), inode, sizeof(*inode));
+    return write_meta(fs, block_no, block);
+}
+
+/* Zero [start, end) of an inode's data block */
+static int zero_range(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                      off_t start, off_t end) {
+    char *zeros;
+    int ret;
+
+    if (start >= end) {
+        return 0;
+    }
+    zeros = calloc(1, end - start);
+    if (!zeros) {
+        return -ENOMEM;
+    }
+    ret = write_at(fs, zeros, end - start,
+                   inode->data_block_no * fs->sb.blocksize + start);
+    free(zeros);
+    return ret;
+}
+
+/* Compressed files, which only pdfs-fuse writes: raw while the
+   data fits in the block, an LZ4-compressed cluster of up to
+   PDFS_COMPRESS_CLUSTER_BLOCKS blocks past that */
+
+static size_t cluster_size(struct pdfs_fuse *fs) {
+    return fs->sb.blocksize * PDFS_COMPRESS_CLUSTER_BLOCKS;
+}
+
+/* Read an inode's data into a zero-padded cluster buffer the caller frees */
+static int load_cluster(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                        char **out) {
+    struct pdfs_compressed_header *header;
+    char block[fs->sb.blocksize];
+    char *cluster;
+    int size = -1;
+    int ret;
+
+    cluster = calloc(1, cluster_size(fs));
+    if (!cluster) {
+        return -ENOMEM;
+    }
+    if (inode->flags & PDFS_INODE_FL_UNWRITTEN) {
+        *out = cluster;
+        return 0;
+    }
+
+    ret = read_at(fs, block, fs->sb.blocksize,
+                  inode->data_block_no * fs->sb.blocksize);
+    if (ret) {
+        free(cluster);
+        return ret;
+    }
+    if (inode->flags & PDFS_INODE_FL_COMPRESSED) {
+        header = (struct pdfs_compressed_header *)block;
+        if (header->compressed_size
+                <= fs->sb.blocksize - sizeof(*header)) {
+            size = LZ4_decompress_safe(block + sizeof(*header), cluster,
+                                       header->compressed_size,
+                                       cluster_size(fs));
+        }
+        if (size < 0 || (uint64_t)size != inode->file_size) {
+            fprintf(stderr, "pdfs: corrupt compressed data in block %"
+                    PRIu64 "\n", inode->data_block_no);
+            free(cluster);
+            return -EIO;
+        }
+    } else {
+        memcpy(cluster, block, inode->file_size < fs->sb.blocksize
+                               ? inode->file_size : fs->sb.blocksize);
+    }
+    *out = cluster;
+    return 0;
+}
+
+/* Write the first size bytes of a cluster to the data block and update the
+   inode flags; the caller saves the inode */
+static int store_cluster(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                         const char *cluster, uint64_t size) {
+    struct pdfs_compressed_header *header;
+    char block[fs->sb.blocksize];
+    int compressed_size;
+    int ret;
+
+    memset(block, 0, sizeof(block));
+    if (size > fs->sb.blocksize) {
+        header = (struct pdfs_compressed_header *)block;
+        compressed_size = LZ4_compress_default(
+            cluster, block + sizeof(*header), size,
+            fs->sb.blocksize - sizeof(*header));
+        if (compressed_size <= 0) {
+            // Incompressible, and too large to be stored raw
+            return -EFBIG;
+        }
+        header->compressed_size = compressed_size;
+    } else {
+        memcpy(block, cluster, size);
+    }
+
+    ret = write_at(fs, block, fs->sb.blocksize,
+                   inode->data_block_no * fs->sb.blocksize);
+    if (ret) {
+        return ret;
+    }
+    if (size > fs->sb.blocksize) {
+        inode->flags |= PDFS_INODE_FL_COMPRESSED;
+    } else {
+        inode->flags &= ~PDFS_INODE_FL_COMPRESSED;
+    }
+    inode->flags &= ~PDFS_INODE_FL_UNWRITTEN;
+    return 0;
+}
+
+/* Bitmaps, same first-fit policy as the kernel allocators */
+
+static int bitmap_alloc(struct pdfs_fuse *fs, uint64_t bitmap_block_no,
+                        uint64_t table_size, uint64_t *out_no) {
+    char bitmap[fs->sb.blocksize];
+    uint64_t i;
+    int ret;
+
+    ret = read_meta(fs, bitmap_block_no, bitmap);
+    if (ret) {
+        return ret;
+    }
+    for (i = 0; i < table_size; i++) {
+        if (0 == (bitmap[i / BITS_IN_BYTE] & (1 << (i % BITS_IN_BYTE)))) {
+            bitmap[i / BITS_IN_BYTE] |= 1 << (i % BITS_IN_BYTE);
+            *out_no = i;
+            return write_meta(fs, bitmap_block_no, bitmap);
+        }
+    }
+    return -ENOSPC;
+}
+
+static int bitmap_free(struct pdfs_fuse *fs, uint64_t bitmap_block_no,
+                       uint64_t no) {
+    char bitmap[fs->sb.blocksize];
+    int ret;
+
+    ret = read_meta(fs, bitmap_block_no, bitmap);
+    if (ret) {
+        return ret;
+    }
+    bitmap[no / BITS_IN_BYTE] &= ~(1 << (no % BITS_IN_BYTE));
+    return write_meta(fs, bitmap_block_no, bitmap);
+}
+
+static void free_inode(struct pdfs_fuse *fs, struct pdfs_inode *inode);
+
+static int alloc_inode(struct pdfs_fuse *fs, mode_t mode,
+                       struct pdfs_inode *inode) {
+    uint64_t inode_no;
+    uint64_t offset;
+    int ret;
+
+    ret = bitmap_alloc(fs, PDFS_INODE_BITMAP_BLOCK_NO,
+                       fs->sb.inode_table_size, &inode_no);
+    if (ret) {
+        return ret;
+    }
+    ret = bitmap_alloc(fs, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO,
+                       fs->sb.data_block_table_size, &offset);
+    if (ret) {
+        bitmap_free(fs, PDFS_INODE_BITMAP_BLOCK_NO, inode_no);
+        return ret;
+    }
+    fs->sb.inode_count += 1;
+    fs->sb.data_block_count += 1;
+
+    memset(inode, 0, sizeof(*inode));
+    inode->mode = mode;
+    inode->inode_no = inode_no;
+    inode->data_block_no
+        = PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&fs->sb) + offset;
+    if (S_ISREG(mode)) {
+        inode->flags |= PDFS_INODE_FL_UNWRITTEN;
+        if (fs->compress) {
+            inode->flags |= PDFS_INODE_FL_COMPRESS;
+        }
+    } else {
+        // An empty directory block still needs a valid checksum
+        char block[fs->sb.blocksize];
+
+        memset(block, 0, sizeof(block));
+        ret = write_meta(fs, inode->data_block_no, block);
+        if (ret) {
+            free_inode(fs, inode);
+            return ret;
+        }
+    }
+
+    ret = save_inode(fs, inode);
+    if (0 == ret) {
+        ret = save_sb(fs);
+    }
+    if (ret) {
+        free_inode(fs, inode);
+    }
+    return ret;
+}
+
+static void free_inode(struct pdfs_fuse *fs, struct pdfs_inode *inode) {
+    bitmap_free(fs, PDFS_DATA_BLOCK_BITMAP_BLOCK_NO,
+                inode->data_block_no
+                    - PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&fs->sb));
+    bitmap_free(fs, PDFS_INODE_BITMAP_BLOCK_NO, inode->inode_no);
+    fs->sb.inode_count -= 1;
+    fs->sb.data_block_count -= 1;
+    save_sb(fs);
+}
+
+/* Drop an unlinked inode once the kernel holds no reference to it */
+static void release_node(struct pdfs_fuse *fs, uint64_t inode_no) {
+    struct pdfs_node *node = &fs->nodes[inode_no];
+    struct pdfs_inode inode;
+
+    if (node->unlinked && 0 == node->nlookup
+            && 0 == load_inode(fs, inode_no, &inode)) {
+        node->unlinked = 0;
+        free_inode(fs, &inode);
+    }
+}
+
+/* Directories */
+
+static uint64_t dir_max_records(struct pdfs_fuse *fs) {
+    return PDFS_DIR_MAX_RECORD_HSB(&fs->sb);
+}
+
+static struct pdfs_dir_record *find_record(struct pdfs_inode *dir,
+                                           struct pdfs_dir_record *records,
+                                           const char *name) {
+    uint64_t i;
+
+    for (i = 0; i < dir->dir_children_count; i++) {
+        if (0 == strcmp(records[i].filename, name)) {
+            return &records[i];
+        }
+    }
+    return NULL;
+}
+
+static int add_record(struct pdfs_fuse *fs, struct pdfs_inode *dir,
+                      const char *name, uint64_t inode_no) {
+    char block[fs->sb.blocksize];
+    struct pdfs_dir_record *records = (struct pdfs_dir_record *)block;
+    int ret;
+
+    if (dir->dir_children_count >= dir_max_records(fs)) {
+        return -ENOSPC;
+    }
+    ret = read_meta(fs, dir->data_block_no, block);
+    if (ret) {
+        return ret;
+    }
+    memset(&records[dir->dir_children_count], 0, sizeof(*records));
+    strcpy(records[dir->dir_children_count].filename, name);
+    records[dir->dir_children_count].inode_no = inode_no;
+    ret = write_meta(fs, dir->data_block_no, block);
+    if (ret) {
+        return ret;
+    }
+    dir->dir_children_count += 1;
+    return save_inode(fs, dir);
+}
+
+/* Same compaction as the kernel: the last record fills the hole */
+static int remove_record(struct pdfs_fuse *fs, struct pdfs_inode *dir,
+                         const char *name) {
+    char block[fs->sb.blocksize];
+    struct pdfs_dir_record *records = (struct pdfs_dir_record *)block;
+    struct pdfs_dir_record *record;
+    struct pdfs_dir_record *last;
+    int ret;
+
+    ret = read_meta(fs, dir->data_block_no, block);
+    if (ret) {
+        return ret;
+    }
+    record = find_record(dir, records, name);
+    if (!record) {
+        return -ENOENT;
+    }
+    last = &records[dir->dir_children_count - 1];
+    if (record != last) {
+        memcpy(record, last, sizeof(*record));
+    }
+    memset(last, 0, sizeof(*last));
+    ret = write_meta(fs, dir->data_block_no, block);
+    if (ret) {
+        return ret;
+    }
+    dir->dir_children_count -= 1;
+    return save_inode(fs, dir);
+}
+
+static int rename_record(struct pdfs_fuse *fs, struct pdfs_inode *dir,
+                         const char *name, const char *newname) {
+    char block[fs->sb.blocksize];
+    struct pdfs_dir_record *record;
+    int ret;
+
+    ret = read_meta(fs, dir->data_block_no, block);
+    if (ret) {
+        return ret;
+    }
+    record = find_record(dir, (struct pdfs_dir_record *)block, name);
+    if (!record) {
+        return -ENOENT;
+    }
+    memset(record->filename, 0, sizeof(record->filename));
+    strcpy(record->filename, newname);
+    return write_meta(fs, dir->data_block_no, block);
+}
+
+static int lookup_name(struct pdfs_fuse *fs, struct pdfs_inode *dir,
+                       const char *name, uint64_t *out_inode_no) {
+    char block[fs->sb.blocksize];
+    struct pdfs_dir_record *record;
+    int ret;
+
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+    if (strlen(name) >= PDFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+    ret = read_meta(fs, dir->data_block_no, block);
+    if (ret) {
+        return ret;
+    }
+    record = find_record(dir, (struct pdfs_dir_record *)block, name);
+    if (!record) {
+        return -ENOENT;
+    }
+    *out_inode_no = record->inode_no;
+    return 0;
+}
+
+/* Replies */
+
+static void fill_stat(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                      struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_ino = PDFS_FUSE_INO(inode->inode_no);
+    st->st_mode = inode->mode;
+    st->st_nlink = S_ISDIR(inode->mode) ? 2 : 1;
+    st->st_uid = getuid();
+    st->st_gid = getgid();
+    st->st_size = S_ISREG(inode->mode) ? inode->file_size : fs->sb.blocksize;
+    st->st_blksize = fs->sb.blocksize;
+    st->st_blocks = fs->sb.blocksize / 512;
+    st->st_atime = st->st_mtime = st->st_ctime = fs->mount_time;
+}
+
+// Callers hold fs->lock, at least for reading
+static void reply_entry(fuse_req_t req, struct pdfs_fuse *fs,
+                        struct pdfs_inode *inode) {
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+    e.ino = PDFS_FUSE_INO(inode->inode_no);
+    e.attr_timeout = fs->attr_timeout;
+    e.entry_timeout = fs->entry_timeout;
+    fill_stat(fs, inode, &e.attr);
+    __atomic_add_fetch(&fs->nodes[inode->inode_no].nlookup, 1,
+                       __ATOMIC_RELAXED);
+    fuse_reply_entry(req, &e);
+}
+
+/* Operations */
+
+static void pdfs_fuse_init(void *userdata, struct fuse_conn_info *conn) {
+    // Zero-copy reads and writes between /dev/fuse and the image
+    if (conn->capable & FUSE_CAP_SPLICE_READ) {
+        conn->want |= FUSE_CAP_SPLICE_READ;
+    }
+    if (conn->capable & FUSE_CAP_SPLICE_WRITE) {
+        conn->want |= FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE;
+    }
+    if (conn->capable & FUSE_CAP_WRITEBACK_CACHE) {
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    }
+}
+
+static void pdfs_fuse_lookup(fuse_req_t req, fuse_ino_t parent,
+                             const char *name) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode dir;
+    struct pdfs_inode inode;
+    struct fuse_entry_param e;
+    uint64_t inode_no;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(parent), &dir);
+    if (!ret) {
+        ret = lookup_name(fs, &dir, name, &inode_no);
+    }
+    if (!ret) {
+        ret = load_inode(fs, inode_no, &inode);
+    }
+    if (!ret) {
+        reply_entry(req, fs, &inode);
+    } else if (-ENOENT == ret && fs->negative_timeout > 0) {
+        // Let the kernel cache the miss as a negative dentry
+        memset(&e, 0, sizeof(e));
+        e.entry_timeout = fs->negative_timeout;
+        fuse_reply_entry(req, &e);
+    } else {
+        fuse_reply_err(req, -ret);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+static void pdfs_fuse_forget_one(struct pdfs_fuse *fs, fuse_ino_t ino,
+                                 uint64_t nlookup) {
+    struct pdfs_node *node = &fs->nodes[PDFS_INODE_NO(ino)];
+
+    node->nlookup -= nlookup < node->nlookup ? nlookup : node->nlookup;
+    release_node(fs, PDFS_INODE_NO(ino));
+}
+
+static void pdfs_fuse_forget(fuse_req_t req, fuse_ino_t ino,
+                             uint64_t nlookup) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+
+    pthread_rwlock_wrlock(&fs->lock);
+    pdfs_fuse_forget_one(fs, ino, nlookup);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_none(req);
+}
+
+static void pdfs_fuse_forget_multi(fuse_req_t req, size_t count,
+                                   struct fuse_forget_data *forgets) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    size_t i;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    for (i = 0; i < count; i++) {
+        pdfs_fuse_forget_one(fs, forgets[i].ino, forgets[i].nlookup);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_none(req);
+}
+
+static void pdfs_fuse_getattr(fuse_req_t req, fuse_ino_t ino,
+                              struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode inode;
+    struct stat st;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fill_stat(fs, &inode, &st);
+    fuse_reply_attr(req, &st, fs->attr_timeout);
+}
+
+/* Resize a regular file. Growing it makes the new tail read as zeros. */
+static int resize(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                  off_t size) {
+    int ret;
+
+    if (inode->flags & PDFS_INODE_FL_COMPRESSED) {
+        return -EOPNOTSUPP;
+    }
+    if ((uint64_t)size > fs->sb.blocksize) {
+        return -EFBIG;
+    }
+    if (0 == size) {
+        inode->flags |= PDFS_INODE_FL_UNWRITTEN;
+    } else if ((uint64_t)size > inode->file_size
+               && !(inode->flags & PDFS_INODE_FL_UNWRITTEN)) {
+        ret = zero_range(fs, inode, inode->file_size, size);
+        if (ret) {
+            return ret;
+        }
+    }
+    inode->file_size = size;
+    return 0;
+}
+
+static void pdfs_fuse_setattr(fuse_req_t req, fuse_ino_t ino,
+                              struct stat *attr, int to_set,
+                              struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode inode;
+    struct stat st;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    if (!ret && (to_set & FUSE_SET_ATTR_MODE)) {
+        inode.mode = (inode.mode & S_IFMT) | (attr->st_mode & ~S_IFMT);
+    }
+    if (!ret && (to_set & FUSE_SET_ATTR_SIZE)) {
+        ret = S_ISREG(inode.mode) ? resize(fs, &inode, attr->st_size)
+                                  : -EISDIR;
+    }
+    if (!ret && (to_set & (FUSE_SET_ATTR_MODE | FUSE_SET_ATTR_SIZE))) {
+        ret = save_inode(fs, &inode);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+
+    // pdfs keeps no owners or times on disk; those changes are dropped
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        return;
+    }
+    fill_stat(fs, &inode, &st);
+    fuse_reply_attr(req, &st, fs->attr_timeout);
+}
+
+static void pdfs_fuse_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
+                              off_t off, struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    char block[fs->sb.blocksize];
+    struct pdfs_dir_record *records = (struct pdfs_dir_record *)block;
+    struct pdfs_inode dir;
+    struct stat st;
+    char *buf;
+    size_t len = 0;
+    size_t entry_len;
+    uint64_t i;
+    int ret;
+
+    buf = malloc(size);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &dir);
+    if (!ret && !S_ISDIR(dir.mode)) {
+        ret = -ENOTDIR;
+    }
+    if (!ret) {
+        ret = read_meta(fs, dir.data_block_no, block);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret) {
+        free(buf);
+        fuse_reply_err(req, -ret);
+        return;
+    }
+
+    // Offsets 1 and 2 follow "." and "..", the records come after them
+    memset(&st, 0, sizeof(st));
+    for (i = off; i < dir.dir_children_count + 2; i++) {
+        if (i < 2) {
+            st.st_ino = ino;
+            st.st_mode = S_IFDIR;
+            entry_len = fuse_add_direntry(req, buf + len, size - len,
+                                          i ? ".." : ".", &st, i + 1);
+        } else {
+            st.st_ino = PDFS_FUSE_INO(records[i - 2].inode_no);
+            st.st_mode = 0;
+            entry_len = fuse_add_direntry(req, buf + len, size - len,
+                                          records[i - 2].filename, &st,
+                                          i + 1);
+        }
+        if (entry_len > size - len) {
+            break;
+        }
+        len += entry_len;
+    }
+
+    fuse_reply_buf(req, buf, len);
+    free(buf);
+}
+
+static void pdfs_fuse_open(fuse_req_t req, fuse_ino_t ino,
+                           struct fuse_file_info *fi) {
+    // Every change goes through this daemon, so cached pages stay valid
+    fi->keep_cache = 1;
+    fuse_reply_open(req, fi);
+}
+
+static void pdfs_fuse_read(fuse_req_t req, fuse_ino_t ino, size_t size,
+                           off_t off, struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct fuse_bufvec buf = FUSE_BUFVEC_INIT(0);
+    struct pdfs_inode inode;
+    char *cluster;
+    char *zeros;
+    int ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+        goto out;
+    }
+
+    if ((uint64_t)off >= inode.file_size) {
+        size = 0;
+    } else if (off + size > inode.file_size) {
+        size = inode.file_size - off;
+    }
+
+    if (inode.flags & PDFS_INODE_FL_UNWRITTEN) {
+        zeros = calloc(1, size ? size : 1);
+        if (!zeros) {
+            fuse_reply_err(req, ENOMEM);
+            goto out;
+        }
+        fuse_reply_buf(req, zeros, size);
+        free(zeros);
+        goto out;
+    }
+
+    if (inode.flags & PDFS_INODE_FL_COMPRESSED) {
+        ret = load_cluster(fs, &inode, &cluster);
+        if (ret) {
+            fuse_reply_err(req, -ret);
+            goto out;
+        }
+        fuse_reply_buf(req, size ? cluster + off : cluster, size);
+        free(cluster);
+        goto out;
+    }
+
+    // Let the kernel splice straight from the image into /dev/fuse
+    buf.buf[0].size = size;
+    buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    buf.buf[0].fd = fs->fd;
+    buf.buf[0].pos = inode.data_block_no * fs->sb.blocksize + off;
+    fuse_reply_data(req, &buf, FUSE_BUF_SPLICE_MOVE);
+
+out:
+    pthread_rwlock_unlock(&fs->lock);
+}
+
+/* Copy a write into the decompressed cluster and store it back whole */
+static ssize_t write_cluster(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                             struct fuse_bufvec *in_buf, off_t off) {
+    size_t size = fuse_buf_size(in_buf);
+    struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(size);
+    uint64_t new_size = inode->file_size;
+    char *cluster;
+    ssize_t copied;
+    int ret;
+
+    ret = load_cluster(fs, inode, &cluster);
+    if (ret) {
+        return ret;
+    }
+    out_buf.buf[0].mem = cluster + off;
+    copied = fuse_buf_copy(&out_buf, in_buf, 0);
+    if (copied >= 0) {
+        if (off + (uint64_t)copied > new_size) {
+            new_size = off + copied;
+        }
+        ret = store_cluster(fs, inode, cluster, new_size);
+        if (ret) {
+            copied = ret;
+        } else {
+            inode->file_size = new_size;
+        }
+    }
+    free(cluster);
+    return copied;
+}
+
+/* Copy a write straight into the inode's data block */
+static ssize_t write_data(struct pdfs_fuse *fs, struct pdfs_inode *inode,
+                          struct fuse_bufvec *in_buf, off_t off) {
+    struct fuse_bufvec out_buf = FUSE_BUFVEC_INIT(fuse_buf_size(in_buf));
+
+    out_buf.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+    out_buf.buf[0].fd = fs->fd;
+    out_buf.buf[0].pos = inode->data_block_no * fs->sb.blocksize + off;
+    return fuse_buf_copy(&out_buf, in_buf, FUSE_BUF_SPLICE_NONBLOCK);
+}
+
+/* Overwrite existing raw data without touching the inode. Returns 0 and
+   leaves the write to the caller if it would change the inode. */
+static ssize_t write_in_place(struct pdfs_fuse *fs, fuse_ino_t ino,
+                              struct fuse_bufvec *in_buf, off_t off) {
+    pthread_mutex_t *data_lock;
+    struct pdfs_inode inode;
+    ssize_t ret;
+
+    pthread_rwlock_rdlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    if (ret || (inode.flags & (PDFS_INODE_FL_UNWRITTEN
+                               | PDFS_INODE_FL_COMPRESS))
+            || off + fuse_buf_size(in_buf) > inode.file_size
+            || 0 == fuse_buf_size(in_buf)) {
+        goto out;
+    }
+
+    data_lock = &fs->data_locks[inode.inode_no % PDFS_FUSE_DATA_LOCKS];
+    pthread_mutex_lock(data_lock);
+    ret = write_data(fs, &inode, in_buf, off);
+    pthread_mutex_unlock(data_lock);
+    if (0 == ret) {
+        ret = -EIO;
+    }
+
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    return ret;
+}
+
+static void pdfs_fuse_write_buf(fuse_req_t req, fuse_ino_t ino,
+                                struct fuse_bufvec *in_buf, off_t off,
+                                struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    size_t size = fuse_buf_size(in_buf);
+    struct pdfs_inode inode;
+    uint64_t max_size = fs->sb.blocksize;
+    ssize_t copied;
+    int ret;
+
+    copied = write_in_place(fs, ino, in_buf, off);
+    if (copied) {
+        if (copied < 0) {
+            fuse_reply_err(req, -copied);
+        } else {
+            fuse_reply_write(req, copied);
+        }
+        return;
+    }
+
+    // The write extends the file or changes its flags
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    if (!ret && (inode.flags & PDFS_INODE_FL_COMPRESS)) {
+        max_size = cluster_size(fs);
+    }
+    if (!ret && off + size > max_size) {
+        ret = -EFBIG;
+    }
+    if (ret) {
+        goto out;
+    }
+
+    if (inode.flags & PDFS_INODE_FL_COMPRESS) {
+        copied = write_cluster(fs, &inode, in_buf, off);
+        if (copied < 0) {
+            ret = copied;
+        } else {
+            ret = save_inode(fs, &inode);
+        }
+        goto out;
+    }
+
+    if (inode.flags & PDFS_INODE_FL_UNWRITTEN) {
+        // First write: the rest of the block must read as zeros
+        ret = zero_range(fs, &inode, 0, fs->sb.blocksize);
+    } else if ((uint64_t)off > inode.file_size) {
+        ret = zero_range(fs, &inode, inode.file_size, off);
+    }
+    if (ret) {
+        goto out;
+    }
+
+    copied = write_data(fs, &inode, in_buf, off);
+    if (copied < 0) {
+        ret = copied;
+        goto out;
+    }
+
+    inode.flags &= ~PDFS_INODE_FL_UNWRITTEN;
+    if (off + (uint64_t)copied > inode.file_size) {
+        inode.file_size = off + copied;
+    }
+    ret = save_inode(fs, &inode);
+
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_write(req, copied);
+    }
+}
+
+static int make_node(fuse_req_t req, fuse_ino_t parent, const char *name,
+                     mode_t mode, struct pdfs_inode *inode) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode dir;
+    uint64_t inode_no;
+    int ret;
+
+    ret = load_inode(fs, PDFS_INODE_NO(parent), &dir);
+    if (ret) {
+        return ret;
+    }
+    ret = lookup_name(fs, &dir, name, &inode_no);
+    if (0 == ret) {
+        return -EEXIST;
+    }
+    if (-ENOENT != ret) {
+        return ret;
+    }
+    if (dir.dir_children_count >= dir_max_records(fs)) {
+        return -ENOSPC;
+    }
+
+    ret = alloc_inode(fs, mode, inode);
+    if (ret) {
+        return ret;
+    }
+    ret = add_record(fs, &dir, name, inode->inode_no);
+    if (ret) {
+        free_inode(fs, inode);
+    }
+    return ret;
+}
+
+static void pdfs_fuse_create(fuse_req_t req, fuse_ino_t parent,
+                             const char *name, mode_t mode,
+                             struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct fuse_entry_param e;
+    struct pdfs_inode inode;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = make_node(req, parent, name, (mode & ~S_IFMT) | S_IFREG, &inode);
+    if (!ret) {
+        memset(&e, 0, sizeof(e));
+        e.ino = PDFS_FUSE_INO(inode.inode_no);
+        e.attr_timeout = fs->attr_timeout;
+        e.entry_timeout = fs->entry_timeout;
+        fill_stat(fs, &inode, &e.attr);
+        fs->nodes[inode.inode_no].nlookup += 1;
+        fi->keep_cache = 1;
+        fuse_reply_create(req, &e, fi);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    }
+}
+
+static void pdfs_fuse_mkdir(fuse_req_t req, fuse_ino_t parent,
+                            const char *name, mode_t mode) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode inode;
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = make_node(req, parent, name, (mode & ~S_IFMT) | S_IFDIR, &inode);
+    if (!ret) {
+        reply_entry(req, fs, &inode);
+    }
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    }
+}
+
+static int remove_node(struct pdfs_fuse *fs, fuse_ino_t parent,
+                       const char *name, int want_dir) {
+    struct pdfs_inode dir;
+    struct pdfs_inode inode;
+    uint64_t inode_no;
+    int ret;
+
+    ret = load_inode(fs, PDFS_INODE_NO(parent), &dir);
+    if (!ret) {
+        ret = lookup_name(fs, &dir, name, &inode_no);
+    }
+    if (!ret) {
+        ret = load_inode(fs, inode_no, &inode);
+    }
+    if (ret) {
+        return ret;
+    }
+    if (want_dir && !S_ISDIR(inode.mode)) {
+        return -ENOTDIR;
+    }
+    if (!want_dir && S_ISDIR(inode.mode)) {
+        return -EISDIR;
+    }
+    if (want_dir && inode.dir_children_count) {
+        return -ENOTEMPTY;
+    }
+
+    ret = remove_record(fs, &dir, name);
+    if (ret) {
+        return ret;
+    }
+    fs->nodes[inode_no].unlinked = 1;
+    release_node(fs, inode_no);
+    return 0;
+}
+
+static void pdfs_fuse_unlink(fuse_req_t req, fuse_ino_t parent,
+                             const char *name) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = remove_node(fs, parent, name, 0);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_err(req, -ret);
+}
+
+static void pdfs_fuse_rmdir(fuse_req_t req, fuse_ino_t parent,
+                            const char *name) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = remove_node(fs, parent, name, 1);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_err(req, -ret);
+}
+
+static int do_rename(struct pdfs_fuse *fs, fuse_ino_t parent,
+                     const char *name, fuse_ino_t newparent,
+                     const char *newname, unsigned int flags) {
+    struct pdfs_inode old_dir;
+    struct pdfs_inode new_dir;
+    struct pdfs_inode target;
+    uint64_t inode_no;
+    uint64_t target_no;
+    int ret;
+
+    if (flags & ~RENAME_NOREPLACE) {
+        return -EINVAL;
+    }
+    if (strlen(newname) >= PDFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+
+    ret = load_inode(fs, PDFS_INODE_NO(parent), &old_dir);
+    if (!ret) {
+        ret = lookup_name(fs, &old_dir, name, &inode_no);
+    }
+    if (!ret) {
+        ret = load_inode(fs, PDFS_INODE_NO(newparent), &new_dir);
+    }
+    if (ret) {
+        return ret;
+    }
+
+    ret = lookup_name(fs, &new_dir, newname, &target_no);
+    if (0 == ret) {
+        if (target_no == inode_no) {
+            return 0;
+        }
+        if (flags & RENAME_NOREPLACE) {
+            return -EEXIST;
+        }
+        ret = remove_node(fs, newparent, newname,
+                          0 == load_inode(fs, target_no, &target)
+                              && S_ISDIR(target.mode));
+        if (ret) {
+            return ret;
+        }
+        // Removing the target may have compacted new_dir
+        ret = load_inode(fs, PDFS_INODE_NO(newparent), &new_dir);
+        if (ret) {
+            return ret;
+        }
+    } else if (-ENOENT != ret) {
+        return ret;
+    }
+
+    // Like the kernel, rename in place within a directory, which works
+    // even when the directory is full
+    if (parent == newparent) {
+        return rename_record(fs, &new_dir, name, newname);
+    }
+    ret = add_record(fs, &new_dir, newname, inode_no);
+    if (ret) {
+        return ret;
+    }
+    return remove_record(fs, &old_dir, name);
+}
+
+static void pdfs_fuse_rename(fuse_req_t req, fuse_ino_t parent,
+                             const char *name, fuse_ino_t newparent,
+                             const char *newname, unsigned int flags) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    int ret;
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = do_rename(fs, parent, name, newparent, newname, flags);
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_err(req, -ret);
+}
+
+/* Same semantics as pdfs_fallocate in the kernel module */
+static void pdfs_fuse_fallocate(fuse_req_t req, fuse_ino_t ino, int mode,
+                                off_t offset, off_t length,
+                                struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode inode;
+    off_t end = offset + length;
+    int ret;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE)) {
+        fuse_reply_err(req, EOPNOTSUPP);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    if (!ret && (inode.flags & PDFS_INODE_FL_COMPRESSED)) {
+        ret = -EOPNOTSUPP;
+    }
+    if (ret) {
+        goto out;
+    }
+
+    if (mode & FALLOC_FL_PUNCH_HOLE) {
+        if ((uint64_t)end > inode.file_size) {
+            end = inode.file_size;
+        }
+        if (offset >= end || (inode.flags & PDFS_INODE_FL_UNWRITTEN)) {
+            goto out;
+        }
+        if (0 == offset && (uint64_t)end == inode.file_size) {
+            inode.flags |= PDFS_INODE_FL_UNWRITTEN;
+        } else {
+            ret = zero_range(fs, &inode, offset, end);
+        }
+    } else if ((uint64_t)end > fs->sb.blocksize) {
+        ret = -EFBIG;
+    } else if (!(mode & FALLOC_FL_KEEP_SIZE)
+               && (uint64_t)end > inode.file_size) {
+        ret = resize(fs, &inode, end);
+    } else if (0 == inode.file_size) {
+        inode.flags |= PDFS_INODE_FL_UNWRITTEN;
+    }
+    if (!ret) {
+        ret = save_inode(fs, &inode);
+    }
+
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_err(req, -ret);
+}
+
+/* FS_IOC_GETFLAGS and FS_IOC_SETFLAGS, for lsattr and chattr +c.
+   FS_COMPR_FL is the only flag pdfs has. */
+static void pdfs_fuse_ioctl(fuse_req_t req, fuse_ino_t ino, int cmd,
+                            void *arg, struct fuse_file_info *fi,
+                            unsigned flags, const void *in_buf,
+                            size_t in_bufsz, size_t out_bufsz) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct pdfs_inode inode;
+    int attr = 0;
+    int ret;
+
+    if (flags & FUSE_IOCTL_COMPAT) {
+        fuse_reply_err(req, ENOSYS);
+        return;
+    }
+
+    switch ((unsigned int)cmd) {
+    case FS_IOC_GETFLAGS:
+        if (out_bufsz < sizeof(attr)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        pthread_rwlock_rdlock(&fs->lock);
+        ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+        pthread_rwlock_unlock(&fs->lock);
+        if (ret) {
+            fuse_reply_err(req, -ret);
+            return;
+        }
+        if (inode.flags & PDFS_INODE_FL_COMPRESS) {
+            attr |= FS_COMPR_FL;
+        }
+        fuse_reply_ioctl(req, 0, &attr, sizeof(attr));
+        return;
+    case FS_IOC_SETFLAGS:
+        if (in_bufsz < sizeof(attr)) {
+            fuse_reply_err(req, EINVAL);
+            return;
+        }
+        memcpy(&attr, in_buf, sizeof(attr));
+        if (attr & ~FS_COMPR_FL) {
+            fuse_reply_err(req, EOPNOTSUPP);
+            return;
+        }
+        break;
+    default:
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+
+    pthread_rwlock_wrlock(&fs->lock);
+    ret = load_inode(fs, PDFS_INODE_NO(ino), &inode);
+    if (ret) {
+        goto out;
+    }
+    if (!S_ISREG(inode.mode)) {
+        ret = attr ? -EOPNOTSUPP : 0;
+        goto out;
+    }
+    if (attr & FS_COMPR_FL) {
+        inode.flags |= PDFS_INODE_FL_COMPRESS;
+    } else if (inode.flags & PDFS_INODE_FL_COMPRESSED) {
+        // The data only fits its block compressed
+        ret = -EFBIG;
+        goto out;
+    } else {
+        inode.flags &= ~PDFS_INODE_FL_COMPRESS;
+    }
+    ret = save_inode(fs, &inode);
+
+out:
+    pthread_rwlock_unlock(&fs->lock);
+    if (ret) {
+        fuse_reply_err(req, -ret);
+    } else {
+        fuse_reply_ioctl(req, 0, NULL, 0);
+    }
+}
+
+static void pdfs_fuse_fsync(fuse_req_t req, fuse_ino_t ino, int datasync,
+                            struct fuse_file_info *fi) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+
+    fuse_reply_err(req, fdatasync(fs->fd) ? errno : 0);
+}
+
+static void pdfs_fuse_statfs(fuse_req_t req, fuse_ino_t ino) {
+    struct pdfs_fuse *fs = PDFS_FUSE(req);
+    struct statvfs st;
+
+    memset(&st, 0, sizeof(st));
+    pthread_rwlock_rdlock(&fs->lock);
+    st.f_bsize = st.f_frsize = fs->sb.blocksize;
+    st.f_blocks = fs->sb.data_block_table_size;
+    st.f_bfree = st.f_bavail
+        = fs->sb.data_block_table_size - fs->sb.data_block_count;
+    st.f_files = fs->sb.inode_table_size;
+    st.f_ffree = st.f_favail = fs->sb.inode_table_size - fs->sb.inode_count;
+    st.f_namemax = PDFS_FILENAME_MAXLEN - 1;
+    pthread_rwlock_unlock(&fs->lock);
+    fuse_reply_statfs(req, &st);
+}
+
+static const struct fuse_lowlevel_ops pdfs_fuse_ops = {
+    .init = pdfs_fuse_init,
+    .lookup = pdfs_fuse_lookup,
+    .forget = pdfs_fuse_forget,
+    .forget_multi = pdfs_fuse_forget_multi,
+    .getattr = pdfs_fuse_getattr,
+    .setattr = pdfs_fuse_setattr,
+    .readdir = pdfs_fuse_readdir,
+    .open = pdfs_fuse_open,
+    .read = pdfs_fuse_read,
+    .write_buf = pdfs_fuse_write_buf,
+    .create = pdfs_fuse_create,
+    .mkdir = pdfs_fuse_mkdir,
+    .unlink = pdfs_fuse_unlink,
+    .rmdir = pdfs_fuse_rmdir,
+    .rename = pdfs_fuse_rename,
+    .fallocate = pdfs_fuse_fallocate,
+    .ioctl = pdfs_fuse_ioctl,
+    .fsync = pdfs_fuse_fsync,
+    .statfs = pdfs_fuse_statfs,
+};
+
+/* Command line */
+
+struct pdfs_fuse_opts {
+    double entry_timeout;
+    double attr_timeout;
+    double negative_timeout;
+    int compress;
+};
+
+static const struct fuse_opt pdfs_fuse_opt_spec[] = {
+    { "entry_timeout=%lf", offsetof(struct pdfs_fuse_opts, entry_timeout), 0 },
+    { "attr_timeout=%lf", offsetof(struct pdfs_fuse_opts, attr_timeout), 0 },
+    { "negative_timeout=%lf",
+      offsetof(struct pdfs_fuse_opts, negative_timeout), 0 },
+    { "compress", offsetof(struct pdfs_fuse_opts, compress), 1 },
+    FUSE_OPT_END
+};
+
+static int open_image(struct pdfs_fuse *fs, const char *path) {
+    int i;
+
+    fs->fd = open(path, O_RDWR);
+    if (fs->fd == -1) {
+        perror("Error opening the image");
+        return -1;
+    }
+    if (sizeof(fs->sb) != pread(fs->fd, &fs->sb, sizeof(fs->sb), 0)) {
+        perror("Error reading the superblock");
+        return -1;
+    }
+    if (fs->sb.magic != PDFS_MAGIC) {
+        fprintf(stderr, "%s is not a pdfs image\n", path);
+        return -1;
+    }
+    if (fs->sb.version != PDFS_VERSION) {
+        fprintf(stderr, "pdfs version %" PRIu64 " is not supported\n",
+                fs->sb.version);
+        return -1;
+    }
+    char block[fs->sb.blocksize];
+    if (read_meta(fs, PDFS_SUPERBLOCK_BLOCK_NO, block)) {
+        return -1;
+    }
+    if (fs->sb.lower_volume_count) {
+        fprintf(stderr, "Stacked volumes are only supported by the "
+                        "kernel module\n");
+        return -1;
+    }
+    fs->nodes = calloc(fs->sb.inode_table_size, sizeof(*fs->nodes));
+    if (!fs->nodes) {
+        perror("calloc");
+        return -1;
+    }
+    pthread_rwlock_init(&fs->lock, NULL);
+    for (i = 0; i < PDFS_FUSE_DATA_LOCKS; i++) {
+        pthread_mutex_init(&fs->data_locks[i], NULL);
+    }
+    fs->mount_time = time(NULL);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    struct fuse_args args;
+    struct fuse_cmdline_opts cmdline;
+    struct fuse_loop_config loop_config;
+    struct pdfs_fuse_opts opts = {
+        // The daemon is the only writer, so the kernel may cache for long
+        .entry_timeout = 60.0,
+        .attr_timeout = 60.0,
+        .negative_timeout = 60.0,
+    };
+    struct fuse_session *se;
+    struct pdfs_fuse fs;
+    int ret = 1;
+
+    if (argc < 3 || argv[1][0] == '-') {
+        fprintf(stderr,
+                "Usage: %s <image> <mountpoint> [options]\n"
+                "    -o entry_timeout=T, attr_timeout=T, negative_timeout=T\n"
+                "       seconds the kernel caches names and attributes\n"
+                "    -o compress\n"
+                "       flag new regular files for compression (chattr +c)\n"
+                "    plus the common FUSE options (-f, -s, -o clone_fd, ...)\n",
+                argv[0]);
+        return 1;
+    }
+
+    memset(&fs, 0, sizeof(fs));
+    if (open_image(&fs, argv[1])) {
+        return 1;
+    }
+
+    // The image is not a FUSE option
+    argv[1] = argv[0];
+    args = (struct fuse_args)FUSE_ARGS_INIT(argc - 1, argv + 1);
+    if (fuse_opt_parse(&args, &opts, pdfs_fuse_opt_spec, NULL) == -1) {
+        return 1;
+    }
+    fs.entry_timeout = opts.entry_timeout;
+    fs.attr_timeout = opts.attr_timeout;
+    fs.negative_timeout = opts.negative_timeout;
+    fs.compress = opts.compress;
+
+    if (fuse_parse_cmdline(&args, &cmdline) != 0 || !cmdline.mountpoint) {
+        fprintf(stderr, "No mountpoint given\n");
+        goto out_args;
+    }
+
+    se = fuse_session_new(&args, &pdfs_fuse_ops, sizeof(pdfs_fuse_ops), &fs);
+    if (!se) {
+        goto out_mountpoint;
+    }
+    if (fuse_set_signal_handlers(se) != 0) {
+        goto out_session;
+    }
+    if (fuse_session_mount(se, cmdline.mountpoint) != 0) {
+        goto out_signals;
+    }
+
+    fuse_daemonize(cmdline.foreground);
+
+    if (cmdline.singlethread) {
+        ret = fuse_session_loop(se);
+    } else {
+        loop_config.clone_fd = cmdline.clone_fd;
+        loop_config.max_idle_threads = cmdline.max_idle_threads;
+        ret = fuse_session_loop_mt(se, &loop_config);
+    }
+
+    fuse_session_unmount(se);
+    fsync(fs.fd);
+out_signals:
+    fuse_remove_signal_handlers(se);
+out_session:
+    fuse_session_destroy(se);
+out_mountpoint:
+    free(cmdline.mountpoint);
+out_args:
+    fuse_opt_free_args(&args);
+    close(fs.fd);
+    return ret ? 1 : 0;
+}
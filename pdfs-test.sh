@@ -5,15 +5,16 @@ set -e
 root_pwd="$PWD"
 test_dir="test-dir-$RANDOM"
 test_mount_point="test-mount-point-$RANDOM"
+test_lower_mount_point="test-lower-mount-point-$RANDOM"
 
 function create_test_image() {
     dd bs=4096 count=6000 if=/dev/zero of="$1"
-    ./mkfs-pdfs "$1"
+    ./mkfs-pdfs "$@"
 }
 
 function mount_fs_image() {
     insmod ./pdfs.ko
-    mount -o loop,owner,group,users -t pdfs "$1" "$2"
+    mount -o loop,owner,group,users${3:+,$3} -t pdfs "$1" "$2"
 }
 
 function unmount_fs() {
@@ -52,6 +53,38 @@ function do_some_operations() {
     cp hello hello_smaller
     echo "smaller" > hello_smaller
     cat hello_smaller
+
+    cp hello hello_removed
+    rm hello_removed
+    test ! -e hello_removed
+
+    cp hello_smaller hello_moved
+    mv hello_moved ../hello_renamed
+    cat ../hello_renamed
+
+    mkdir dir3
+    rmdir dir3
+    test ! -e dir3
+
+    fallocate -l 1024 hello_prealloc
+    test "$(stat -c %s hello_prealloc)" = 1024
+    cmp -n 1024 hello_prealloc /dev/zero
+
+    # in-kernel copies, over a longer file and into a new one
+    echo "Longer than the second level directory line" > hello_overwritten
+    "$root_pwd/pdfs-cp" hello hello_overwritten
+    cmp hello hello_overwritten
+    "$root_pwd/pdfs-cp" hello hello_copied
+    cmp hello hello_copied
+    test "$(stat -c %s hello_copied)" = "$(stat -c %s hello)"
+
+    # truncation cuts the data, and growing back reads zeros past the cut
+    cp hello hello_truncated
+    truncate -s 6 hello_truncated
+    truncate -s 20 hello_truncated
+    test "$(stat -c %s hello_truncated)" = 20
+    cmp -n 6 hello hello_truncated
+    cmp -i 6:0 -n 14 hello_truncated /dev/zero
 }
 
 function do_read_operations()
@@ -67,25 +100,53 @@ function do_read_operations()
     cd dir1
     cat hello
 
+    cat hello_renamed
+
     cd dir2
     cat hello
     cat hello_smaller
+    test ! -e hello_removed
+    test ! -e dir3
+    cmp -n 1024 hello_prealloc /dev/zero
+    cmp hello hello_copied
+}
+
+function do_layered_operations()
+{
+    cd "$1"
+    ls -lR
+
+    # from the lower volume
+    cat dir1/hello
+    cat dir1/dir2/hello_smaller
+
+    # lower volumes are read-only
+    if echo "Upper layer" > dir1/hello; then
+        return 1
+    fi
+
+    echo "Upper layer" > hello_upper
+    cat hello_upper
 }
 
 function cleanup() {
     cd "$root_pwd"
+    mount | grep -q "$test_mount_point type fuse" && fusermount3 -u "$test_mount_point"
     mount | grep -q "$test_mount_point" && umount -t pdfs "$test_mount_point"
+    mount | grep -q "$test_lower_mount_point" && umount -t pdfs "$test_lower_mount_point"
     lsmod | grep -q pdfs && rmmod "$root_pwd/pdfs.ko"
-    rm -fR "$test_dir" "$test_mount_point"
+    rm -fR "$test_dir" "$test_mount_point" "$test_lower_mount_point"
 }
 
 set -x
 make
+# insmod doesn't resolve module dependencies; pdfs needs crc32c()
+modprobe libcrc32c
 
 cleanup
 trap cleanup SIGINT EXIT
-mkdir "$test_dir" "$test_mount_point"
-create_test_image "$test_dir/image"
+mkdir "$test_dir" "$test_mount_point" "$test_lower_mount_point"
+lower_volume_id=$(create_test_image "$test_dir/image" | awk '/Volume id/ {print $3}')
 
 # run 1
 mount_fs_image "$test_dir/image" "$test_mount_point"
@@ -94,14 +155,100 @@ cd "$root_pwd"
 unmount_fs "$test_mount_point"
 
 # run 2
-mount_fs_image "$test_dir/image" "$test_mount_point"
+mount_fs_image "$test_dir/image" "$test_mount_point" prefetch
 do_read_operations "$test_mount_point"
 cd "$root_pwd"
 ls -lR "$test_mount_point"
 unmount_fs "$test_mount_point"
 
+# run 3: a new volume stacked on the image of runs 1 and 2
+create_test_image "$test_dir/upper-image" "$lower_volume_id"
+insmod ./pdfs.ko
+mount -o loop,ro -t pdfs "$test_dir/image" "$test_lower_mount_point"
+mount -o loop -t pdfs "$test_dir/upper-image" "$test_mount_point"
+do_layered_operations "$test_mount_point"
+cd "$root_pwd"
+# the lower volume stays read-only while the upper one is mounted
+if mount -o remount,rw "$test_lower_mount_point"; then
+    exit 1
+fi
+# remount changes options, and rejects unknown ones
+mount -o remount,prefetch "$test_mount_point"
+grep "$test_mount_point" /proc/mounts | grep -q prefetch
+if mount -o remount,nosuchoption "$test_mount_point"; then
+    exit 1
+fi
+umount "$test_mount_point"
+umount "$test_lower_mount_point"
+rmmod ./pdfs.ko
+
+# run 4: a corrupted inode table block fails its checksum, so the root
+# inode can't be read and the mount is refused
+cp "$test_dir/image" "$test_dir/corrupt-image"
+printf '\xff' | dd of="$test_dir/corrupt-image" bs=1 seek=$((3 * 4096 + 8)) \
+    conv=notrunc
+insmod ./pdfs.ko
+if mount -o loop -t pdfs "$test_dir/corrupt-image" "$test_mount_point"; then
+    exit 1
+fi
+rmmod ./pdfs.ko
+
+# run 5: compression, which only pdfs-fuse writes. A compressible file
+# larger than a block is stored LZ4-compressed and survives a remount.
+make pdfs-fuse
+create_test_image "$test_dir/compress-image"
+yes pdfs | head -c 12000 > "$test_dir/compressible"
+./pdfs-fuse "$test_dir/compress-image" "$test_mount_point" -o compress
+cp "$test_dir/compressible" "$test_mount_point/big"
+cmp "$test_dir/compressible" "$test_mount_point/big"
+echo "Hello World" > "$test_mount_point/small"
+fusermount3 -u "$test_mount_point"
+
+./pdfs-fuse "$test_dir/compress-image" "$test_mount_point"
+cmp "$test_dir/compressible" "$test_mount_point/big"
+lsattr "$test_mount_point/big" | cut -d ' ' -f 1 | grep -q c
+# Without the option new files aren't flagged, and can't outgrow a block
+echo "Hello World" > "$test_mount_point/raw"
+if cat "$test_dir/compressible" > "$test_mount_point/raw"; then
+    exit 1
+fi
+# until chattr +c flags them
+chattr +c "$test_mount_point/raw"
+cat "$test_dir/compressible" > "$test_mount_point/raw"
+cmp "$test_dir/compressible" "$test_mount_point/raw"
+# The data only fits its block compressed
+if chattr -c "$test_mount_point/raw"; then
+    exit 1
+fi
+fusermount3 -u "$test_mount_point"
+
+# The kernel module reads compressed files, but doesn't write them
+mount_fs_image "$test_dir/compress-image" "$test_mount_point"
+cmp "$test_dir/compressible" "$test_mount_point/big"
+cmp "$test_dir/compressible" "$test_mount_point/raw"
+test "$(cat "$test_mount_point/small")" = "Hello World"
+if echo "more" >> "$test_mount_point/big"; then
+    exit 1
+fi
+unmount_fs "$test_mount_point"
+
+# run 6: the image of runs 1 and 2, compacted into a new image
+./pdfs-defrag "$test_dir/image" "$test_dir/defrag-image"
+mount_fs_image "$test_dir/defrag-image" "$test_mount_point"
+do_read_operations "$test_mount_point"
+cd "$root_pwd"
+unmount_fs "$test_mount_point"
+
+# and in place, through a copy renamed over the image
+./pdfs-defrag "$test_dir/image"
+test -z "$(ls "$test_dir" | grep 'image.defrag-')"
+mount_fs_image "$test_dir/image" "$test_mount_point"
+do_read_operations "$test_mount_point"
+cd "$root_pwd"
+unmount_fs "$test_mount_point"
+
 echo "Test finished successfully!"
 cleanup
 
 make clean
-rm -rf "$test_dir/image" "$test_mount_point"
+rm -rf "$test_dir/image" "$test_mount_point" "$test_lower_mount_point"
@@ -3,10 +3,13 @@
 
 #define BITS_IN_BYTE 8
 #define PDFS_MAGIC 0x19690716
+// Version 2 added the checksum tail to metadata blocks
+#define PDFS_VERSION 2
 #define PDFS_DEFAULT_BLOCKSIZE 4096
 #define PDFS_DEFAULT_INODE_TABLE_SIZE 1024
 #define PDFS_DEFAULT_DATA_BLOCK_TABLE_SIZE 1024
 #define PDFS_FILENAME_MAXLEN 255
+#define PDFS_MAX_LOWER_VOLUMES 4
 
 /* Define filesystem structures */
 
@@ -17,10 +20,36 @@ struct pdfs_dir_record {
     uint64_t inode_no;
 };
 
+// Metadata blocks (superblock, bitmaps, inode table and directory blocks)
+// end with a tail. checksum is the crc32c, seeded with ~0 and not inverted,
+// of the block number followed by the block up to the tail.
+struct pdfs_block_tail {
+    uint32_t checksum;
+    uint32_t reserved;
+};
+
+// data_block_no is allocated but its contents were never written:
+// reads return zeros without touching the disk
+#define PDFS_INODE_FL_UNWRITTEN 0x1
+// Keep the file's data LZ4-compressed once it outgrows a block, which lets
+// it hold up to PDFS_COMPRESS_CLUSTER_BLOCKS blocks of compressible data
+#define PDFS_INODE_FL_COMPRESS 0x2
+// data_block_no holds a pdfs_compressed_header followed by an LZ4 block
+// that decompresses to file_size bytes. Only set together with COMPRESS.
+#define PDFS_INODE_FL_COMPRESSED 0x4
+
+#define PDFS_COMPRESS_CLUSTER_BLOCKS 4
+
+struct pdfs_compressed_header {
+    uint32_t compressed_size;
+    uint32_t reserved;
+};
+
 struct pdfs_inode {
     mode_t mode;
     uint64_t inode_no;
     uint64_t data_block_no;
+    uint64_t flags;
 
     // TODO struct timespec is defined kenrel space,
     // but mkfs-pdfs.c is compiled in user space
@@ -44,8 +73,31 @@ struct pdfs_superblock {
 
     uint64_t data_block_table_size;
     uint64_t data_block_count;
+
+    // Random identifier, by which upper volumes refer to this one
+    uint64_t volume_id;
+    // Volumes stacked below this one. Lookups that miss in this volume
+    // fall through to them, in order.
+    uint64_t lower_volume_count;
+    uint64_t lower_volume_ids[PDFS_MAX_LOWER_VOLUMES];
 };
 
+/* ioctl interface */
+
+// Copy src_length bytes at src_offset of src_fd into the file the ioctl is
+// issued on, at dest_offset, without a round trip through userspace.
+// Returns the number of bytes copied.
+struct pdfs_copy_range_args {
+    int64_t src_fd;
+    uint64_t src_offset;
+    uint64_t src_length;
+    uint64_t dest_offset;
+};
+
+#define PDFS_IOC_MAGIC 0xb7
+#define PDFS_IOC_COPY_RANGE _IOW(PDFS_IOC_MAGIC, 1, \
+                                 struct pdfs_copy_range_args)
+
 static const uint64_t PDFS_SUPERBLOCK_BLOCK_NO = 0;
 static const uint64_t PDFS_INODE_BITMAP_BLOCK_NO = 1;
 static const uint64_t PDFS_DATA_BLOCK_BITMAP_BLOCK_NO = 2;
@@ -58,9 +110,26 @@ static const uint64_t PDFS_ROOTDIR_DATA_BLOCK_NO_OFFSET = 0;
 
 /* Helper functions */
 
+static inline uint64_t PDFS_BLOCK_TAIL_OFFSET_HSB(
+        struct pdfs_superblock *pdfs_sb) {
+    return pdfs_sb->blocksize - sizeof(struct pdfs_block_tail);
+}
+
 static inline uint64_t PDFS_INODES_PER_BLOCK_HSB(
         struct pdfs_superblock *pdfs_sb) {
-    return pdfs_sb->blocksize / sizeof(struct pdfs_inode);
+    return PDFS_BLOCK_TAIL_OFFSET_HSB(pdfs_sb) / sizeof(struct pdfs_inode);
+}
+
+static inline uint64_t PDFS_DIR_MAX_RECORD_HSB(
+        struct pdfs_superblock *pdfs_sb) {
+    return PDFS_BLOCK_TAIL_OFFSET_HSB(pdfs_sb)
+           / sizeof(struct pdfs_dir_record);
+}
+
+// Bitmap blocks have as many bits as there are bytes before the tail
+static inline uint64_t PDFS_BITMAP_MAX_BITS_HSB(
+        struct pdfs_superblock *pdfs_sb) {
+    return PDFS_BLOCK_TAIL_OFFSET_HSB(pdfs_sb) * BITS_IN_BYTE;
 }
 
 static inline uint64_t PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(
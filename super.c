@@ -1,11 +1,305 @@
 #include "kpdfs.h"
+#include "kpdfs_trace.h"
+
+/* Mounted volumes, for resolving lower_volume_ids */
+static LIST_HEAD(pdfs_volumes);
+static DEFINE_MUTEX(pdfs_volumes_lock);
+
+enum {
+    Opt_discard, Opt_nodiscard, Opt_prefetch, Opt_noprefetch, Opt_err
+};
+
+static const match_table_t pdfs_tokens = {
+    {Opt_discard, "discard"},
+    {Opt_nodiscard, "nodiscard"},
+    {Opt_prefetch, "prefetch"},
+    {Opt_noprefetch, "noprefetch"},
+    {Opt_err, NULL}
+};
+
+static int pdfs_parse_options(char *options, unsigned long *mount_opts) {
+    substring_t args[MAX_OPT_ARGS];
+    char *p;
+    int token;
+
+    if (!options) {
+        return 0;
+    }
+
+    while ((p = strsep(&options, ",")) != NULL) {
+        if (!*p) {
+            continue;
+        }
+        token = match_token(p, pdfs_tokens, args);
+        switch (token) {
+        case Opt_discard:
+            *mount_opts |= PDFS_MOUNT_DISCARD;
+            break;
+        case Opt_nodiscard:
+            *mount_opts &= ~PDFS_MOUNT_DISCARD;
+            break;
+        case Opt_prefetch:
+            *mount_opts |= PDFS_MOUNT_PREFETCH;
+            break;
+        case Opt_noprefetch:
+            *mount_opts &= ~PDFS_MOUNT_PREFETCH;
+            break;
+        default:
+            printk(KERN_ERR "pdfs: unrecognized mount option \"%s\"\n", p);
+            return -EINVAL;
+        }
+    }
+    return 0;
+}
+
+static void pdfs_check_discard(struct super_block *sb,
+                                  unsigned long *mount_opts) {
+    if ((*mount_opts & PDFS_MOUNT_DISCARD)
+            && !blk_queue_discard(bdev_get_queue(sb->s_bdev))) {
+        printk(KERN_WARNING
+               "pdfs: mounting with \"discard\" option, but "
+               "the device does not support discard\n");
+        *mount_opts &= ~PDFS_MOUNT_DISCARD;
+    }
+}
+
+static void pdfs_detach_lower_volumes(struct super_block *sb) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    unsigned int i;
+
+    for (i = 0; i < sbi->lower_count; i++) {
+        atomic_dec(&PDFS_SB_INFO(sbi->lowers[i])->upper_count);
+        deactivate_super(sbi->lowers[i]);
+    }
+    sbi->lower_count = 0;
+    sbi->layer_count = 1;
+}
+
+/* Pin the volumes named by lower_volume_ids, which must already be mounted
+   read-only, and flatten the DAG below this volume into sbi->layers */
+static int pdfs_attach_lower_volumes(struct super_block *sb) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    struct pdfs_superblock *pdfs_sb = PDFS_SB(sb);
+    struct pdfs_sb_info *lower;
+    struct pdfs_sb_info *volume;
+    uint64_t i;
+    unsigned int j;
+    unsigned int k;
+    int ret = 0;
+
+    sbi->layers[0] = sb;
+    sbi->layer_count = 1;
+
+    if (pdfs_sb->lower_volume_count > PDFS_MAX_LOWER_VOLUMES) {
+        printk(KERN_ERR "pdfs: too many lower volumes: %llu\n",
+               pdfs_sb->lower_volume_count);
+        return -EINVAL;
+    }
+
+    mutex_lock(&pdfs_volumes_lock);
+    for (i = 0; i < pdfs_sb->lower_volume_count; i++) {
+        lower = NULL;
+        list_for_each_entry(volume, &pdfs_volumes, volume_list) {
+            if (volume->pdfs_sb.volume_id == pdfs_sb->lower_volume_ids[i]) {
+                lower = volume;
+                break;
+            }
+        }
+        if (!lower || !atomic_inc_not_zero(&lower->sb->s_active)) {
+            printk(KERN_ERR "pdfs: lower volume %016llx is not mounted\n",
+                   pdfs_sb->lower_volume_ids[i]);
+            ret = -ENOENT;
+            break;
+        }
+        sbi->lowers[sbi->lower_count++] = lower->sb;
+        atomic_inc(&lower->upper_count);
+        if (!(lower->sb->s_flags & MS_RDONLY)) {
+            printk(KERN_ERR
+                   "pdfs: lower volume %016llx must be mounted read-only\n",
+                   lower->pdfs_sb.volume_id);
+            ret = -EINVAL;
+            break;
+        }
+
+        for (j = 0; j < lower->layer_count; j++) {
+            for (k = 0; k < sbi->layer_count; k++) {
+                if (sbi->layers[k] == lower->layers[j]) {
+                    break;
+                }
+            }
+            if (k < sbi->layer_count) {
+                continue;
+            }
+            if (sbi->layer_count == PDFS_MAX_LAYERS) {
+                printk(KERN_ERR "pdfs: more than %d stacked volumes\n",
+                       PDFS_MAX_LAYERS);
+                ret = -ELOOP;
+                break;
+            }
+            sbi->layers[sbi->layer_count++] = lower->layers[j];
+        }
+        if (ret) {
+            break;
+        }
+    }
+    mutex_unlock(&pdfs_volumes_lock);
+
+    if (ret) {
+        pdfs_detach_lower_volumes(sb);
+    }
+    return ret;
+}
+
+/* The root directory spans the roots of every layer */
+static int pdfs_merge_lower_roots(struct super_block *sb,
+                                     struct pdfs_inode *root_pdfs_inode) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    struct pdfs_inode *lower_root;
+    unsigned int i;
+    int ret;
+
+    for (i = 1; i < sbi->layer_count; i++) {
+        lower_root = pdfs_get_pdfs_inode(sbi->layers[i],
+                                         PDFS_ROOTDIR_INODE_NO);
+        if (IS_ERR(lower_root)) {
+            return PTR_ERR(lower_root);
+        }
+        ret = pdfs_add_lower_dir(root_pdfs_inode, lower_root);
+        if (ret) {
+            pdfs_free_inode_buf(lower_root);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+/* A directory block to read during prefetch, and how many records it has */
+struct pdfs_prefetch_dir {
+    uint64_t block_no;
+    uint64_t count;
+};
+
+/* Collect the subdirectories of the count directories in dirs into next.
+   Their blocks were read ahead by the previous level, and the inode table
+   by the first batch, so the reads here only wait for I/O in flight.
+   Returns the number of subdirectories. */
+static uint64_t pdfs_prefetch_subdirs(struct super_block *sb,
+                                      struct pdfs_prefetch_dir *dirs,
+                                      uint64_t count,
+                                      struct pdfs_prefetch_dir *next) {
+    struct pdfs_dir_record *dir_record;
+    struct pdfs_inode *child;
+    struct buffer_head *bh;
+    struct buffer_head *inode_bh;
+    uint64_t next_count = 0;
+    uint64_t inode_no;
+    uint64_t i;
+    uint64_t j;
+
+    for (i = 0; i < count; i++) {
+        bh = pdfs_bread_meta(sb, dirs[i].block_no);
+        if (!bh) {
+            continue;
+        }
+        /* Racing with creates at worst prefetches a stale record */
+        dir_record = (struct pdfs_dir_record *)bh->b_data;
+        for (j = 0; j < dirs[i].count; j++, dir_record++) {
+            inode_no = dir_record->inode_no;
+            if (inode_no >= PDFS_SB(sb)->inode_table_size) {
+                continue;
+            }
+            inode_bh = pdfs_bread_meta(sb, PDFS_INODE_TABLE_START_BLOCK_NO
+                                           + PDFS_INODE_BLOCK_OFFSET(
+                                                 sb, inode_no));
+            if (!inode_bh) {
+                continue;
+            }
+            child = (struct pdfs_inode *)(inode_bh->b_data
+                                          + PDFS_INODE_BYTE_OFFSET(
+                                                sb, inode_no));
+            if (S_ISDIR(child->mode)) {
+                next[next_count].block_no = child->data_block_no;
+                next[next_count].count = min(child->dir_children_count,
+                                             PDFS_DIR_MAX_RECORD(sb));
+                next_count++;
+            }
+            brelse(inode_bh);
+        }
+        brelse(bh);
+    }
+    return next_count;
+}
+
+/* -o prefetch: the tree walk that usually follows a mount would otherwise
+   pay a synchronous read per inode. Read the bitmaps and the whole inode
+   table in one batch. Then, one level at a time down to
+   PDFS_PREFETCH_DEPTH levels below the root, find the subdirectories of
+   the level and read all their blocks ahead in one batch. Each batch is
+   issued under one plug with no waits inside it, so adjacent blocks go out
+   as few large requests. */
+void pdfs_prefetch_work(struct work_struct *work) {
+    struct pdfs_sb_info *sbi;
+    struct super_block *sb;
+    struct pdfs_inode *root_pdfs_inode;
+    struct pdfs_prefetch_dir *dirs;
+    struct pdfs_prefetch_dir *next;
+    struct blk_plug plug;
+    uint64_t block_no;
+    uint64_t count;
+    uint64_t i;
+    int level;
+
+    sbi = container_of(work, struct pdfs_sb_info, prefetch_work);
+    sb = sbi->sb;
+
+    blk_start_plug(&plug);
+    for (block_no = PDFS_INODE_BITMAP_BLOCK_NO;
+         block_no < PDFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb); block_no++) {
+        sb_breadahead(sb, block_no);
+    }
+    blk_finish_plug(&plug);
+
+    root_pdfs_inode = pdfs_get_pdfs_inode(sb, PDFS_ROOTDIR_INODE_NO);
+    if (IS_ERR(root_pdfs_inode)) {
+        return;
+    }
+    dirs = kmalloc(sizeof(*dirs), GFP_KERNEL);
+    if (!dirs) {
+        pdfs_free_inode_buf(root_pdfs_inode);
+        return;
+    }
+    dirs[0].block_no = root_pdfs_inode->data_block_no;
+    dirs[0].count = min(root_pdfs_inode->dir_children_count,
+                        PDFS_DIR_MAX_RECORD(sb));
+    count = 1;
+    pdfs_free_inode_buf(root_pdfs_inode);
+
+    for (level = 0; level < PDFS_PREFETCH_DEPTH && count; level++) {
+        next = kmalloc_array(count * PDFS_DIR_MAX_RECORD(sb), sizeof(*next),
+                             GFP_KERNEL);
+        if (!next) {
+            break;
+        }
+        count = pdfs_prefetch_subdirs(sb, dirs, count, next);
+        kfree(dirs);
+        dirs = next;
+
+        blk_start_plug(&plug);
+        for (i = 0; i < count; i++) {
+            sb_breadahead(sb, dirs[i].block_no);
+        }
+        blk_finish_plug(&plug);
+    }
+    kfree(dirs);
+}
 
 static int pdfs_fill_super(struct super_block *sb, void *data, int silent) {
     struct inode *root_inode;
     struct pdfs_inode *root_pdfs_inode;
     struct buffer_head *bh;
     struct pdfs_superblock *pdfs_sb;
-    int ret = 0;
+    struct pdfs_sb_info *sbi;
+    int ret = -EINVAL;
 
     bh = sb_bread(sb, PDFS_SUPERBLOCK_BLOCK_NO);
     BUG_ON(!bh);
@@ -23,17 +317,77 @@ static int pdfs_fill_super(struct super_block *sb, void *data, int silent) {
                sb->s_blocksize);
         goto release;
     }
+    if (unlikely(pdfs_sb->version != PDFS_VERSION)) {
+        printk(KERN_ERR
+               "pdfs version %llu is not supported, expected %d\n",
+               pdfs_sb->version, PDFS_VERSION);
+        goto release;
+    }
+    if (pdfs_verify_meta(sb, bh)) {
+        ret = -EIO;
+        goto release;
+    }
+    if (unlikely(pdfs_sb->inode_table_size > PDFS_BITMAP_MAX_BITS_HSB(pdfs_sb)
+            || pdfs_sb->data_block_table_size
+               > PDFS_BITMAP_MAX_BITS_HSB(pdfs_sb))) {
+        printk(KERN_ERR "pdfs tables are larger than their bitmaps\n");
+        goto release;
+    }
+
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi) {
+        ret = -ENOMEM;
+        goto release;
+    }
+    sbi->sb = sb;
+    memcpy(&sbi->pdfs_sb, pdfs_sb, sizeof(sbi->pdfs_sb));
+    spin_lock_init(&sbi->discard_lock);
+    INIT_LIST_HEAD(&sbi->discard_list);
+    INIT_DELAYED_WORK(&sbi->discard_work, pdfs_discard_work);
+    INIT_WORK(&sbi->prefetch_work, pdfs_prefetch_work);
+
+    ret = pdfs_parse_options(data, &sbi->mount_opts);
+    if (ret) {
+        goto free_sbi;
+    }
+    pdfs_check_discard(sb, &sbi->mount_opts);
 
-    sb->s_magic = pdfs_sb->magic;
-    sb->s_fs_info = pdfs_sb;
-    sb->s_maxbytes = pdfs_sb->blocksize;
+    sb->s_magic = sbi->pdfs_sb.magic;
+    sb->s_fs_info = sbi;
+    /* Only files compressed by pdfs-fuse get past their first block */
+    sb->s_maxbytes = sbi->pdfs_sb.blocksize * PDFS_COMPRESS_CLUSTER_BLOCKS;
     sb->s_op = &pdfs_sb_ops;
 
+    sbi->stats = alloc_percpu(struct pdfs_op_stats);
+    if (!sbi->stats) {
+        ret = -ENOMEM;
+        goto free_sbi;
+    }
+    ret = pdfs_sysfs_register(sb);
+    if (ret) {
+        goto free_stats;
+    }
+
+    ret = pdfs_attach_lower_volumes(sb);
+    if (ret) {
+        goto unregister;
+    }
+
     root_pdfs_inode = pdfs_get_pdfs_inode(sb, PDFS_ROOTDIR_INODE_NO);
+    if (IS_ERR(root_pdfs_inode)) {
+        ret = PTR_ERR(root_pdfs_inode);
+        goto detach;
+    }
+    ret = pdfs_merge_lower_roots(sb, root_pdfs_inode);
+    if (ret) {
+        pdfs_free_inode_buf(root_pdfs_inode);
+        goto detach;
+    }
     root_inode = new_inode(sb);
-    if (!root_inode || !root_pdfs_inode) {
+    if (!root_inode) {
+        pdfs_free_inode_buf(root_pdfs_inode);
         ret = -ENOMEM;
-        goto release;
+        goto detach;
     }
     pdfs_fill_inode(sb, root_inode, root_pdfs_inode);
     inode_init_owner(root_inode, NULL, root_inode->i_mode);
@@ -41,9 +395,30 @@ static int pdfs_fill_super(struct super_block *sb, void *data, int silent) {
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
         ret = -ENOMEM;
-        goto release;
+        goto detach;
     }
 
+    mutex_lock(&pdfs_volumes_lock);
+    list_add(&sbi->volume_list, &pdfs_volumes);
+    mutex_unlock(&pdfs_volumes_lock);
+
+    if (sbi->mount_opts & PDFS_MOUNT_PREFETCH) {
+        queue_work(system_unbound_wq, &sbi->prefetch_work);
+    }
+
+    ret = 0;
+    goto release;
+
+detach:
+    pdfs_detach_lower_volumes(sb);
+unregister:
+    pdfs_sysfs_unregister(sb);
+free_stats:
+    free_percpu(sbi->stats);
+free_sbi:
+    /* put_super is not called when fill_super fails */
+    sb->s_fs_info = NULL;
+    kfree(sbi);
 release:
     brelse(bh);
     return ret;
@@ -72,18 +447,94 @@ void pdfs_kill_superblock(struct super_block *sb) {
 }
 
 void pdfs_put_super(struct super_block *sb) {
-    return;
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+
+    mutex_lock(&pdfs_volumes_lock);
+    list_del(&sbi->volume_list);
+    mutex_unlock(&pdfs_volumes_lock);
+
+    cancel_work_sync(&sbi->prefetch_work);
+
+    /* Inodes evicted during unmount may just have queued discards */
+    flush_delayed_work(&sbi->discard_work);
+
+    pdfs_detach_lower_volumes(sb);
+    pdfs_sysfs_unregister(sb);
+    free_percpu(sbi->stats);
+
+    sb->s_fs_info = NULL;
+    kfree(sbi);
+}
+
+/* Options not given keep their value. discard applies to blocks freed from
+   now on; turning prefetch on warms the caches again. */
+int pdfs_remount(struct super_block *sb, int *flags, char *data) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    unsigned long mount_opts = sbi->mount_opts;
+    int ret;
+
+    ret = pdfs_parse_options(data, &mount_opts);
+    if (ret) {
+        return ret;
+    }
+    pdfs_check_discard(sb, &mount_opts);
+
+    if (!(*flags & MS_RDONLY)) {
+        /* Upper volumes check MS_RDONLY under pdfs_volumes_lock while they
+           attach, so drop it under the lock too; the VFS sets the same
+           flags once this returns */
+        mutex_lock(&pdfs_volumes_lock);
+        if (atomic_read(&sbi->upper_count)) {
+            mutex_unlock(&pdfs_volumes_lock);
+            printk(KERN_ERR
+                   "pdfs: volume %016llx is a lower volume of a mounted "
+                   "volume and must stay read-only\n",
+                   sbi->pdfs_sb.volume_id);
+            return -EBUSY;
+        }
+        sb->s_flags &= ~MS_RDONLY;
+        mutex_unlock(&pdfs_volumes_lock);
+    }
+
+    if ((mount_opts & PDFS_MOUNT_PREFETCH)
+            && !(sbi->mount_opts & PDFS_MOUNT_PREFETCH)) {
+        queue_work(system_unbound_wq, &sbi->prefetch_work);
+    }
+    sbi->mount_opts = mount_opts;
+    return 0;
+}
+
+int pdfs_show_options(struct seq_file *seq, struct dentry *root) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(root->d_sb);
+
+    if (sbi->mount_opts & PDFS_MOUNT_DISCARD) {
+        seq_puts(seq, ",discard");
+    }
+    if (sbi->mount_opts & PDFS_MOUNT_PREFETCH) {
+        seq_puts(seq, ",prefetch");
+    }
+    return 0;
 }
 
 void pdfs_save_sb(struct super_block *sb) {
     struct buffer_head *bh;
     struct pdfs_superblock *pdfs_sb = PDFS_SB(sb);
+    u64 start = pdfs_stats_start();
 
-    bh = sb_bread(sb, PDFS_SUPERBLOCK_BLOCK_NO);
-    BUG_ON(!bh);
+    trace_pdfs_save_sb(sb);
 
-    bh->b_data = (char *)pdfs_sb;
-    mark_buffer_dirty(bh);
+    bh = pdfs_bread_meta(sb, PDFS_SUPERBLOCK_BLOCK_NO);
+    if (unlikely(!bh)) {
+        pdfs_stats_end(sb, PDFS_OP_SAVE_SB, start, -EIO);
+        return;
+    }
+
+    lock_buffer(bh);
+    memcpy(bh->b_data, pdfs_sb, sizeof(*pdfs_sb));
+    pdfs_mark_meta_dirty(sb, bh);
+    unlock_buffer(bh);
     sync_dirty_buffer(bh);
     brelse(bh);
+
+    pdfs_stats_end(sb, PDFS_OP_SAVE_SB, start, 0);
 }
@@ -0,0 +1,178 @@
+#include "kpdfs.h"
+
+/* /sys/fs/pdfs/<dev>/ holds, for every operation in enum pdfs_op,
+   <op>_count, <op>_errors, <op>_latency_ns (total) and
+   <op>_latency_histogram (PDFS_LATENCY_BUCKETS log2 buckets) */
+
+static struct kset *pdfs_kset;
+
+void pdfs_stats_end(struct super_block *sb, enum pdfs_op op,
+                       u64 start_ns, long ret) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    u64 delta = pdfs_stats_start() - start_ns;
+    unsigned int bucket;
+
+    bucket = delta ? min_t(unsigned int, ilog2(delta),
+                           PDFS_LATENCY_BUCKETS - 1) : 0;
+
+    this_cpu_inc(sbi->stats->count[op]);
+    if (ret < 0) {
+        this_cpu_inc(sbi->stats->errors[op]);
+    }
+    this_cpu_add(sbi->stats->latency_ns[op], delta);
+    this_cpu_inc(sbi->stats->latency_hist[op][bucket]);
+}
+
+struct pdfs_attr {
+    struct attribute attr;
+    ssize_t (*show)(struct pdfs_sb_info *sbi, enum pdfs_op op, char *buf);
+    enum pdfs_op op;
+};
+
+/* Sum one u64 of struct pdfs_op_stats, at byte offset, over all CPUs */
+static u64 pdfs_stats_sum(struct pdfs_sb_info *sbi, size_t offset) {
+    u64 sum = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+        sum += *(u64 *)((char *)per_cpu_ptr(sbi->stats, cpu) + offset);
+    }
+    return sum;
+}
+
+static ssize_t pdfs_count_show(struct pdfs_sb_info *sbi, enum pdfs_op op,
+                                  char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%llu\n",
+                    pdfs_stats_sum(sbi, offsetof(struct pdfs_op_stats,
+                                                 count[op])));
+}
+
+static ssize_t pdfs_errors_show(struct pdfs_sb_info *sbi, enum pdfs_op op,
+                                   char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%llu\n",
+                    pdfs_stats_sum(sbi, offsetof(struct pdfs_op_stats,
+                                                 errors[op])));
+}
+
+static ssize_t pdfs_latency_show(struct pdfs_sb_info *sbi, enum pdfs_op op,
+                                    char *buf) {
+    return snprintf(buf, PAGE_SIZE, "%llu\n",
+                    pdfs_stats_sum(sbi, offsetof(struct pdfs_op_stats,
+                                                 latency_ns[op])));
+}
+
+static ssize_t pdfs_histogram_show(struct pdfs_sb_info *sbi,
+                                      enum pdfs_op op, char *buf) {
+    ssize_t len = 0;
+    unsigned int i;
+
+    for (i = 0; i < PDFS_LATENCY_BUCKETS; i++) {
+        len += scnprintf(buf + len, PAGE_SIZE - len, "%s%llu",
+                         i ? " " : "",
+                         pdfs_stats_sum(sbi,
+                                        offsetof(struct pdfs_op_stats,
+                                                 latency_hist[op][i])));
+    }
+    len += scnprintf(buf + len, PAGE_SIZE - len, "\n");
+    return len;
+}
+
+#define PDFS_OP_ATTR(_op, _name, _show)                      \
+static struct pdfs_attr pdfs_attr_##_name = {                \
+    .attr = { .name = #_name, .mode = S_IRUGO },             \
+    .show = _show,                                           \
+    .op = _op,                                               \
+}
+
+#define PDFS_OP_ATTRS(_op, _prefix)                                      \
+    PDFS_OP_ATTR(_op, _prefix##_count, pdfs_count_show);                 \
+    PDFS_OP_ATTR(_op, _prefix##_errors, pdfs_errors_show);               \
+    PDFS_OP_ATTR(_op, _prefix##_latency_ns, pdfs_latency_show);          \
+    PDFS_OP_ATTR(_op, _prefix##_latency_histogram, pdfs_histogram_show)
+
+#define PDFS_OP_ATTR_LIST(_prefix)                   \
+    &pdfs_attr_##_prefix##_count.attr,               \
+    &pdfs_attr_##_prefix##_errors.attr,              \
+    &pdfs_attr_##_prefix##_latency_ns.attr,          \
+    &pdfs_attr_##_prefix##_latency_histogram.attr
+
+PDFS_OP_ATTRS(PDFS_OP_LOOKUP, lookup);
+PDFS_OP_ATTRS(PDFS_OP_CREATE, create);
+PDFS_OP_ATTRS(PDFS_OP_ALLOC_INODE, alloc_inode);
+PDFS_OP_ATTRS(PDFS_OP_ALLOC_DATA_BLOCK, alloc_data_block);
+PDFS_OP_ATTRS(PDFS_OP_READ, read);
+PDFS_OP_ATTRS(PDFS_OP_WRITE, write);
+PDFS_OP_ATTRS(PDFS_OP_SAVE_SB, save_sb);
+
+static struct attribute *pdfs_attrs[] = {
+    PDFS_OP_ATTR_LIST(lookup),
+    PDFS_OP_ATTR_LIST(create),
+    PDFS_OP_ATTR_LIST(alloc_inode),
+    PDFS_OP_ATTR_LIST(alloc_data_block),
+    PDFS_OP_ATTR_LIST(read),
+    PDFS_OP_ATTR_LIST(write),
+    PDFS_OP_ATTR_LIST(save_sb),
+    NULL,
+};
+
+static ssize_t pdfs_attr_show(struct kobject *kobj,
+                                 struct attribute *attr, char *buf) {
+    struct pdfs_sb_info *sbi;
+    struct pdfs_attr *a;
+
+    sbi = container_of(kobj, struct pdfs_sb_info, s_kobj);
+    a = container_of(attr, struct pdfs_attr, attr);
+    return a->show(sbi, a->op, buf);
+}
+
+static const struct sysfs_ops pdfs_attr_ops = {
+    .show = pdfs_attr_show,
+};
+
+static void pdfs_sb_release(struct kobject *kobj) {
+    struct pdfs_sb_info *sbi;
+
+    sbi = container_of(kobj, struct pdfs_sb_info, s_kobj);
+    complete(&sbi->s_kobj_unregister);
+}
+
+static struct kobj_type pdfs_sb_ktype = {
+    .default_attrs = pdfs_attrs,
+    .sysfs_ops = &pdfs_attr_ops,
+    .release = pdfs_sb_release,
+};
+
+int pdfs_sysfs_register(struct super_block *sb) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+    int ret;
+
+    sbi->s_kobj.kset = pdfs_kset;
+    init_completion(&sbi->s_kobj_unregister);
+    ret = kobject_init_and_add(&sbi->s_kobj, &pdfs_sb_ktype, NULL,
+                               "%s", sb->s_id);
+    if (ret) {
+        kobject_put(&sbi->s_kobj);
+        wait_for_completion(&sbi->s_kobj_unregister);
+    }
+    return ret;
+}
+
+void pdfs_sysfs_unregister(struct super_block *sb) {
+    struct pdfs_sb_info *sbi = PDFS_SB_INFO(sb);
+
+    kobject_del(&sbi->s_kobj);
+    kobject_put(&sbi->s_kobj);
+    wait_for_completion(&sbi->s_kobj_unregister);
+}
+
+int pdfs_sysfs_init(void) {
+    pdfs_kset = kset_create_and_add("pdfs", NULL, fs_kobj);
+    if (!pdfs_kset) {
+        return -ENOMEM;
+    }
+    return 0;
+}
+
+void pdfs_sysfs_exit(void) {
+    kset_unregister(pdfs_kset);
+}